@@ -11,6 +11,9 @@
 #define NOB_IMPLEMENTATION
 #include "nob.h"
 
+#define ARENA_IMPLEMENTATION
+#include "arena.h"
+
 #define K 5
 #define SAMPLE_RADIUS 4.0f
 #define MEAN_RADIUS (3*SAMPLE_RADIUS)
@@ -25,7 +28,7 @@ typedef struct {
     size_t capacity;
 } Samples2D;
 
-static void generate_cluster(Vector2 center, float radius, size_t count, Samples2D *samples)
+static void generate_cluster(Arena *arena, Vector2 center, float radius, size_t count, Samples2D *samples)
 {
     for (size_t i = 0; i < count; ++i) {
         float angle = rand_float()*2*PI;
@@ -34,23 +37,27 @@ static void generate_cluster(Vector2 center, float radius, size_t count, Samples
             .x = cosf(angle)*mag,
             .y = sinf(angle)*mag,
         };
-        nob_da_append(samples, Vector2Add(sample, center));
+        arena_da_append(arena, samples, Vector2Add(sample, center));
     }
 }
 
+// The samples are rebuilt on every state change, so they are allocated from arenas and freed in bulk
+static Arena set_arena = {0};
 static Samples2D set = {0};
+static Arena clusters_arena = {0};
 static Samples2D clusters[K] = {0};
 static Vector2 means[K] = {0};
 
 void generate_new_state(float min_x, float max_x, float min_y, float max_y)
 {
 #ifndef LEAF
-    set.count = 0;
-    generate_cluster(CLITERAL(Vector2){0}, 10, 100, &set);
-    generate_cluster(CLITERAL(Vector2){min_x*0.5f, max_y*0.5f}, 5, 50, &set);
-    generate_cluster(CLITERAL(Vector2){max_x*0.5f, max_y*0.5f}, 5, 50, &set);
-    generate_cluster(CLITERAL(Vector2){min_x*0.5f, min_y*0.5f}, 5, 50, &set);
-    generate_cluster(CLITERAL(Vector2){max_x*0.5f, min_y*0.5f}, 5, 50, &set);
+    arena_reset(&set_arena);
+    set = (Samples2D) {0};
+    generate_cluster(&set_arena, CLITERAL(Vector2){0}, 10, 100, &set);
+    generate_cluster(&set_arena, CLITERAL(Vector2){min_x*0.5f, max_y*0.5f}, 5, 50, &set);
+    generate_cluster(&set_arena, CLITERAL(Vector2){max_x*0.5f, max_y*0.5f}, 5, 50, &set);
+    generate_cluster(&set_arena, CLITERAL(Vector2){min_x*0.5f, min_y*0.5f}, 5, 50, &set);
+    generate_cluster(&set_arena, CLITERAL(Vector2){max_x*0.5f, min_y*0.5f}, 5, 50, &set);
 #endif
 
     for (size_t i = 0; i < K; ++i) {
@@ -61,8 +68,13 @@ void generate_new_state(float min_x, float max_x, float min_y, float max_y)
 
 void recluster_state(void)
 {
+    // The appends to the clusters interleave, so at most one of them could grow in place. Reserve
+    // each one for as many samples as it had in the previous iteration instead, means move little.
+    arena_reset(&clusters_arena);
     for (size_t j = 0; j < K; ++j) {
-        clusters[j].count = 0;
+        size_t expected = clusters[j].count > 0 ? clusters[j].count : set.count/K;
+        clusters[j] = (Samples2D) {0};
+        arena_da_reserve(&clusters_arena, &clusters[j], expected);
     }
     for (size_t i = 0; i < set.count; ++i) {
         Vector2 p = set.items[i];
@@ -76,7 +88,7 @@ void recluster_state(void)
                 k = j;
             }
         }
-        nob_da_append(&clusters[k], p);
+        arena_da_append(&clusters_arena, &clusters[k], p);
     }
 }
 
@@ -143,7 +155,7 @@ int main(int argc, char **argv)
             default: {}
             }
         }
-        nob_da_append(&set, p);
+        arena_da_append(&set_arena, &set, p);
         if (p.x < min_x) min_x = p.x;
         if (p.x > max_x) max_x = p.x;
         if (p.y < min_y) min_y = p.y;
@@ -11,6 +11,9 @@
 #define NOB_IMPLEMENTATION
 #include "nob.h"
 
+#define ARENA_IMPLEMENTATION
+#include "arena.h"
+
 #define STB_DS_IMPLEMENTATION
 #include "stb_ds.h"
 
@@ -29,7 +32,7 @@ typedef struct {
     size_t capacity;
 } Samples3D;
 
-static void generate_cluster(Vector3 center, float radius, size_t count, Samples3D *samples)
+static void generate_cluster(Arena *arena, Vector3 center, float radius, size_t count, Samples3D *samples)
 {
     for (size_t i = 0; i < count; ++i) {
         float mag = rand_float()*radius;
@@ -40,20 +43,24 @@ static void generate_cluster(Vector3 center, float radius, size_t count, Samples
             .y = sinf(theta)*sinf(phi)*mag,
             .z = cosf(theta)*mag,
         };
-        nob_da_append(samples, Vector3Add(sample, center));
+        arena_da_append(arena, samples, Vector3Add(sample, center));
     }
 }
 
+// The set is generated once and only grows, the clusters are rebuilt on every recluster and
+// freed in bulk with arena_reset()
+static Arena set_arena = {0};
 static Samples3D set = {0};
+static Arena clusters_arena = {0};
 static Samples3D clusters[K] = {0};
 static Vector3 means[K] = {0};
 
 void generate_new_state(float cluster_radius, size_t cluster_count)
 {
 #ifndef IMAGE
-    generate_cluster((Vector3) {0, 0, 0}, cluster_radius, cluster_count, &set);
-    generate_cluster((Vector3) {-cluster_radius, cluster_radius, 0}, cluster_radius/2, cluster_count/2, &set);
-    generate_cluster((Vector3) {cluster_radius, cluster_radius, 0}, cluster_radius/2, cluster_count/2, &set);
+    generate_cluster(&set_arena, (Vector3) {0, 0, 0}, cluster_radius, cluster_count, &set);
+    generate_cluster(&set_arena, (Vector3) {-cluster_radius, cluster_radius, 0}, cluster_radius/2, cluster_count/2, &set);
+    generate_cluster(&set_arena, (Vector3) {cluster_radius, cluster_radius, 0}, cluster_radius/2, cluster_count/2, &set);
 #else
     (void) cluster_count;
 #endif
@@ -67,8 +74,13 @@ void generate_new_state(float cluster_radius, size_t cluster_count)
 
 void recluster_state(void)
 {
+    // The appends to the clusters interleave, so at most one of them could grow in place. Reserve
+    // each one for as many samples as it had in the previous iteration instead, means move little.
+    arena_reset(&clusters_arena);
     for (size_t j = 0; j < K; ++j) {
-        clusters[j].count = 0;
+        size_t expected = clusters[j].count > 0 ? clusters[j].count : set.count/K;
+        clusters[j] = (Samples3D) {0};
+        arena_da_reserve(&clusters_arena, &clusters[j], expected);
     }
     for (size_t i = 0; i < set.count; ++i) {
         Vector3 p = set.items[i];
@@ -82,7 +94,7 @@ void recluster_state(void)
                 k = j;
             }
         }
-        nob_da_append(&clusters[k], p);
+        arena_da_append(&clusters_arena, &clusters[k], p);
     }
 }
 
@@ -168,7 +180,7 @@ int main(int argc, char **argv)
             .y = unique_points[i].key.g/255.0f*cluster_radius,
             .z = unique_points[i].key.b/255.0f*cluster_radius,
         };
-        nob_da_append(&set, sample);
+        arena_da_append(&set_arena, &set, sample);
     }
 #endif // IMAGE
 
@@ -24,6 +24,10 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 #ifndef ARENA_ASSERT
 #include <assert.h>
@@ -39,34 +43,207 @@
 #define ARENA_BACKEND ARENA_BACKEND_LIBC_MALLOC
 #endif // ARENA_BACKEND
 
+// Pages backing the regions of an arena. Only the mmap backend supports the huge pages,
+// the other ones always use the default pages.
+typedef enum {
+    ARENA_PAGES_DEFAULT = 0,
+    // 2MB aligned regions advised with MADV_HUGEPAGE, so transparent huge pages can back them
+    ARENA_PAGES_HUGE,
+    // MAP_HUGETLB regions out of the preallocated huge page pool, falls back to ARENA_PAGES_HUGE
+    ARENA_PAGES_HUGETLB,
+    // Regions advised with MADV_NOHUGEPAGE, so they stay on 4KB pages even when THP is set to always
+    ARENA_PAGES_SMALL,
+} Arena_Pages;
+
+#define ARENA_HUGE_PAGE_SIZE ((size_t)2*1024*1024)
+
 typedef struct Region Region;
 
 struct Region {
     Region *next;
     size_t count;
     size_t capacity;
+#if ARENA_BACKEND == ARENA_BACKEND_LINUX_MMAP
+    // The whole capacity is reserved up front, but only the first `committed` words are accessible
+    size_t committed;
+    Arena_Pages pages;
+#endif
     uintptr_t data[];
 };
 
+// Compile with -DARENA_STATS to collect the statistics of each arena, see arena_stats_dump()
+#ifdef ARENA_STATS
+typedef struct {
+    size_t new_region_calls;
+    size_t regions_skipped;       // regions arena_alloc() moved past because the allocation did not fit
+    size_t oversized_allocs;      // allocations that exceeded REGION_DEFAULT_CAPACITY
+    size_t allocs;
+    size_t bytes_requested;
+    size_t bytes_wasted_alignment;
+    size_t bytes_wasted_tails;    // unused ends of the skipped regions
+    size_t bytes_in_use;
+    size_t peak_bytes_in_use;
+    size_t regions_count;
+    size_t bytes_reserved;
+    size_t bytes_trimmed;
+    size_t bytes_rss_reclaimed;   // resident memory given back by arena_trim() and arena_reset_decommit()
+} Arena_Stats;
+#endif // ARENA_STATS
+
 typedef struct {
     Region *begin, *end;
+    // Must be set before the first allocation
+    Arena_Pages pages;
+#ifdef ARENA_STATS
+    Arena_Stats stats;
+#endif // ARENA_STATS
 } Arena;
 
 #define REGION_DEFAULT_CAPACITY (8*1024)
 
+// Every new region is ARENA_REGION_GROWTH_FACTOR times bigger than the last one of the arena,
+// but not bigger than ARENA_REGION_MAX_CAPACITY (unless a single allocation needs more),
+// so big arenas do not turn into long chains of small regions. Both are in words.
+#ifndef ARENA_REGION_GROWTH_FACTOR
+#define ARENA_REGION_GROWTH_FACTOR 2
+#endif
+#ifndef ARENA_REGION_MAX_CAPACITY
+#define ARENA_REGION_MAX_CAPACITY (8*1024*1024)
+#endif
+
+#if ARENA_BACKEND == ARENA_BACKEND_LINUX_MMAP
+// The Linux mmap backend reserves this much of the address space for every region, so an
+// arena normally stays a single contiguous region whose pages are committed as it grows.
+// When the address space is limited (e.g. ulimit -v) the reservations are halved down to
+// what the region actually needs and the arena falls back to a chain of smaller regions.
+#ifndef ARENA_MMAP_RESERVE_SIZE
+#define ARENA_MMAP_RESERVE_SIZE ((size_t)16*1024*1024*1024)
+#endif
+// Pages are committed in steps of at least this many bytes
+#ifndef ARENA_MMAP_COMMIT_SIZE
+#define ARENA_MMAP_COMMIT_SIZE ((size_t)64*1024)
+#endif
+#endif // ARENA_BACKEND_LINUX_MMAP
+
+// Return NULL when the backend can not provide the memory
 Region *new_region(size_t capacity);
+Region *new_region_pages(size_t capacity, Arena_Pages pages);
 void free_region(Region *r);
 
-// TODO: snapshot/rewind capability for the arena
-// - Snapshot should be combination of a->end and a->end->count.
-// - Rewinding should be restoring a->end and a->end->count from the snapshot and
-// setting count-s of all the Region-s after the remembered a->end to 0.
+// Assert that the memory was available, use arena_try_alloc() to back off instead
 void *arena_alloc(Arena *a, size_t size_bytes);
+// `align` must be a power of two, e.g. a cache line or the page size
+void *arena_alloc_aligned(Arena *a, size_t size_bytes, size_t align);
+// Return NULL when there is no memory left, just like malloc()
+void *arena_try_alloc(Arena *a, size_t size_bytes);
+void *arena_try_alloc_aligned(Arena *a, size_t size_bytes, size_t align);
 void *arena_realloc(Arena *a, void *oldptr, size_t oldsz, size_t newsz);
 char *arena_sprintf(Arena *a, const char *format, ...);
 
 void arena_reset(Arena *a);
 void arena_free(Arena *a);
+// Bytes allocated since the last reset, including the alignment padding and the region tails
+// that were skipped
+size_t arena_used_bytes(const Arena *a);
+// Releases the memory of the arena beyond the regions in use and the first `retain_bytes`,
+// e.g. after arena_reset() so a long-running process does not hold on to its peak forever
+void arena_trim(Arena *a, size_t retain_bytes);
+// arena_reset() that also gives the pages past the first `threshold_bytes` of the arena back
+// to the OS (madvise(ARENA_DECOMMIT_ADVICE)) without releasing the regions or their reservation.
+// Only the mmap backend decommits, the others just reset.
+void arena_reset_decommit(Arena *a, size_t threshold_bytes);
+
+// Position of the arena to rewind to, releasing everything allocated after it in O(1)
+typedef struct {
+    Region *region;
+    size_t count;
+#ifdef ARENA_STATS
+    size_t bytes_in_use;
+#endif // ARENA_STATS
+} Arena_Mark;
+
+Arena_Mark arena_snapshot(Arena *a);
+void arena_rewind(Arena *a, Arena_Mark m);
+
+// Dynamic arrays (structs with items, count and capacity like the ones of nob.h) whose
+// storage comes from the arena. They are never freed individually, only together with the
+// arena. Thanks to arena_realloc() the most recently allocated array grows in place.
+#define ARENA_DA_INIT_CAP 256
+
+#define arena_da_reserve(a, da, expected_capacity)                                                 \
+    do {                                                                                          \
+        if ((expected_capacity) > (da)->capacity) {                                               \
+            size_t arena_da_new_capacity = (da)->capacity == 0 ? ARENA_DA_INIT_CAP : (da)->capacity; \
+            while ((expected_capacity) > arena_da_new_capacity) arena_da_new_capacity *= 2;       \
+            (da)->items = arena_realloc((a), (da)->items,                                         \
+                                        (da)->capacity*sizeof(*(da)->items),                      \
+                                        arena_da_new_capacity*sizeof(*(da)->items));              \
+            (da)->capacity = arena_da_new_capacity;                                               \
+        }                                                                                         \
+    } while (0)
+
+#define arena_da_append(a, da, item)                     \
+    do {                                                 \
+        arena_da_reserve((a), (da), (da)->count + 1);    \
+        (da)->items[(da)->count++] = (item);             \
+    } while (0)
+
+#define arena_da_append_many(a, da, new_items, new_items_count)                                    \
+    do {                                                                                          \
+        arena_da_reserve((a), (da), (da)->count + (new_items_count));                             \
+        memcpy((da)->items + (da)->count, (new_items), (new_items_count)*sizeof(*(da)->items));  \
+        (da)->count += (new_items_count);                                                         \
+    } while (0)
+
+// Pool of fixed-size objects on top of an arena: O(1) alloc and free through a free list,
+// with the objects carved out of the arena POOL_SLAB_OBJECTS at a time and only given back
+// to the OS together with the pool. Safe to use from several threads. The free list and the
+// arena have separate locks, so the threads freeing or reusing objects never wait for a new
+// slab being mapped.
+#define POOL_SLAB_OBJECTS 64
+
+typedef struct Pool_Object Pool_Object;
+
+struct Pool_Object {
+    Pool_Object *next;
+};
+
+#ifdef ARENA_STATS
+typedef struct {
+    size_t allocs;
+    size_t frees;
+    size_t live;
+    size_t peak_live;
+    size_t slabs;
+} Pool_Stats;
+#endif // ARENA_STATS
+
+typedef struct {
+    Arena arena;
+    size_t object_size;
+    size_t align;
+    Pool_Object *free_list;
+    pthread_mutex_t lock;
+    // Guards the arena
+    pthread_mutex_t slab_lock;
+#ifdef ARENA_STATS
+    Pool_Stats stats;
+#endif // ARENA_STATS
+} Pool;
+
+// `align` must be a power of two, 0 means the alignment of a pointer
+void pool_init(Pool *p, size_t object_size, size_t align);
+// Returns NULL when there is no memory left for a new slab
+void *pool_alloc(Pool *p);
+void pool_free(Pool *p, void *ptr);
+// Frees all of the objects at once
+void pool_destroy(Pool *p);
+
+#ifdef ARENA_STATS
+#include <stdio.h>
+void arena_stats_dump(const Arena *a, const char *name, FILE *stream);
+void pool_stats_dump(const Pool *p, const char *name, FILE *stream);
+#endif // ARENA_STATS
 
 #endif // ARENA_H_
 
@@ -82,7 +259,7 @@ Region *new_region(size_t capacity)
     size_t size_bytes = sizeof(Region) + sizeof(uintptr_t)*capacity;
     // TODO: it would be nice if we could guarantee that the regions are allocated by ARENA_BACKEND_LIBC_MALLOC are page aligned
     Region *r = malloc(size_bytes);
-    ARENA_ASSERT(r);
+    if (r == NULL) return NULL;
     r->next = NULL;
     r->count = 0;
     r->capacity = capacity;
@@ -93,8 +270,184 @@ void free_region(Region *r)
 {
     free(r);
 }
+
+Region *new_region_pages(size_t capacity, Arena_Pages pages)
+{
+    (void)pages;
+    return new_region(capacity);
+}
+
+#define region_commit(r, size) ((void)(r), (void)(size), true)
+#define region_decommit(r, size, resident) ((void)(r), (void)(size), *(resident) = 0, (size_t)0)
 #elif ARENA_BACKEND == ARENA_BACKEND_LINUX_MMAP
-#  error "TODO: Linux mmap backend is not implemented yet"
+#include <unistd.h>
+#include <sys/mman.h>
+
+static size_t region_page_size(void)
+{
+    static size_t page_size = 0;
+    if (page_size == 0) page_size = sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+static size_t region_round_up(size_t size_bytes, size_t page_size)
+{
+    return (size_bytes + page_size - 1)/page_size*page_size;
+}
+
+static size_t region_round_to_pages(size_t size_bytes)
+{
+    return region_round_up(size_bytes, region_page_size());
+}
+
+// Huge page backed regions are committed and decommitted by whole huge pages, otherwise the
+// kernel has to split them or can not use them at all
+static size_t region_commit_granularity(const Region *r)
+{
+    return r->pages == ARENA_PAGES_HUGE ? ARENA_HUGE_PAGE_SIZE : region_page_size();
+}
+
+// Makes the first `size` words of the region accessible
+static bool region_commit_slow(Region *r, size_t size)
+{
+    size_t granularity = region_commit_granularity(r);
+    size_t begin = region_round_up(sizeof(Region) + sizeof(uintptr_t)*r->committed, granularity);
+    size_t end = sizeof(Region) + sizeof(uintptr_t)*size;
+    if (end < begin + ARENA_MMAP_COMMIT_SIZE) end = begin + ARENA_MMAP_COMMIT_SIZE;
+    end = region_round_up(end, granularity);
+    size_t limit = region_round_to_pages(sizeof(Region) + sizeof(uintptr_t)*r->capacity);
+    if (end > limit) end = limit;
+    // Fails with ENOMEM when the commit charge is limited (vm.overcommit_memory=2)
+    if (mprotect((char*)r + begin, end - begin, PROT_READ | PROT_WRITE) != 0) return false;
+    r->committed = (end - sizeof(Region))/sizeof(uintptr_t);
+    if (r->committed > r->capacity) r->committed = r->capacity;
+    return true;
+}
+
+#define region_commit(r, size) ((size) <= (r)->committed || region_commit_slow((r), (size)))
+
+// MADV_FREE is cheaper, but the kernel takes the pages back only under memory pressure
+#ifndef ARENA_DECOMMIT_ADVICE
+#define ARENA_DECOMMIT_ADVICE MADV_DONTNEED
+#endif
+
+#ifdef ARENA_STATS
+static size_t region_resident_bytes(char *begin, size_t size)
+{
+    size_t page_size = region_page_size();
+    unsigned char vec[1024];
+    size_t resident = 0;
+    for (size_t offset = 0; offset < size; offset += sizeof(vec)*page_size) {
+        size_t n = size - offset < sizeof(vec)*page_size ? size - offset : sizeof(vec)*page_size;
+        if (mincore(begin + offset, n, vec) != 0) return 0;
+        for (size_t i = 0; i < (n + page_size - 1)/page_size; ++i) {
+            if (vec[i] & 1) resident += page_size;
+        }
+    }
+    return resident;
+}
+#endif // ARENA_STATS
+
+// Gives the pages past the first `size` words of the region back to the OS keeping them
+// reserved. Returns the amount of decommitted bytes and, in the stats mode, how much of
+// them was resident.
+static size_t region_decommit(Region *r, size_t size, size_t *resident)
+{
+    *resident = 0;
+    // The huge page pool is not given back page by page
+    if (r->pages == ARENA_PAGES_HUGETLB) return 0;
+    size_t granularity = region_commit_granularity(r);
+    size_t begin = region_round_up(sizeof(Region) + sizeof(uintptr_t)*size, granularity);
+    size_t end = region_round_up(sizeof(Region) + sizeof(uintptr_t)*r->committed, granularity);
+    if (begin >= end) return 0;
+#ifdef ARENA_STATS
+    *resident = region_resident_bytes((char*)r + begin, end - begin);
+#endif // ARENA_STATS
+    int ret = madvise((char*)r + begin, end - begin, ARENA_DECOMMIT_ADVICE);
+    ARENA_ASSERT(ret == 0 && "madvise() failed");
+    ret = mprotect((char*)r + begin, end - begin, PROT_NONE);
+    ARENA_ASSERT(ret == 0 && "mprotect() failed");
+    r->committed = (begin - sizeof(Region))/sizeof(uintptr_t);
+    return end - begin;
+}
+
+// The huge page pool is usually small, so MAP_HUGETLB regions are mapped and committed with
+// exactly the requested capacity instead of reserving ARENA_MMAP_RESERVE_SIZE
+static Region *new_region_hugetlb(size_t capacity)
+{
+#ifdef MAP_HUGETLB
+    size_t size_bytes = region_round_up(sizeof(Region) + sizeof(uintptr_t)*capacity, ARENA_HUGE_PAGE_SIZE);
+    Region *r = mmap(NULL, size_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (r == MAP_FAILED) return NULL;
+    r->next = NULL;
+    r->count = 0;
+    r->capacity = (size_bytes - sizeof(Region))/sizeof(uintptr_t);
+    r->committed = r->capacity;
+    r->pages = ARENA_PAGES_HUGETLB;
+    return r;
+#else
+    (void)capacity;
+    return NULL;
+#endif
+}
+
+Region *new_region_pages(size_t capacity, Arena_Pages pages)
+{
+    if (pages == ARENA_PAGES_HUGETLB) {
+        Region *r = new_region_hugetlb(capacity);
+        if (r != NULL) return r;
+        pages = ARENA_PAGES_HUGE;
+    }
+
+    size_t alignment = pages == ARENA_PAGES_HUGE ? ARENA_HUGE_PAGE_SIZE : region_page_size();
+    size_t needed_bytes = region_round_up(sizeof(Region) + sizeof(uintptr_t)*capacity, alignment);
+    if (needed_bytes < alignment + ARENA_MMAP_COMMIT_SIZE) needed_bytes = region_round_up(alignment + ARENA_MMAP_COMMIT_SIZE, alignment);
+    // Shrinks once the address space runs out so the following regions do not retry the sizes that failed
+    static _Atomic size_t reserve_size = ARENA_MMAP_RESERVE_SIZE;
+    size_t size_bytes = region_round_up(atomic_load(&reserve_size), alignment);
+    if (size_bytes < needed_bytes) size_bytes = needed_bytes;
+    char *p = MAP_FAILED;
+    size_t reserved = 0;
+    for (;;) {
+        // Over-reserve to cut out the aligned part
+        reserved = size_bytes + alignment - region_page_size();
+        p = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p != MAP_FAILED) break;
+        if (size_bytes == needed_bytes) return NULL;
+        size_bytes = region_round_up(size_bytes/2, alignment);
+        if (size_bytes < needed_bytes) size_bytes = needed_bytes;
+        if (size_bytes < atomic_load(&reserve_size)) atomic_store(&reserve_size, size_bytes);
+    }
+    char *aligned = (char*)region_round_up((uintptr_t)p, alignment);
+    if (aligned > p) munmap(p, aligned - p);
+    if (aligned + size_bytes < p + reserved) munmap(aligned + size_bytes, p + reserved - (aligned + size_bytes));
+    // Failing is fine, e.g. when THP are disabled
+    if (pages == ARENA_PAGES_HUGE) madvise(aligned, size_bytes, MADV_HUGEPAGE);
+    if (pages == ARENA_PAGES_SMALL) madvise(aligned, size_bytes, MADV_NOHUGEPAGE);
+
+    Region *r = (Region*)aligned;
+    if (mprotect(r, alignment, PROT_READ | PROT_WRITE) != 0) {
+        munmap(aligned, size_bytes);
+        return NULL;
+    }
+    r->next = NULL;
+    r->count = 0;
+    r->capacity = (size_bytes - sizeof(Region))/sizeof(uintptr_t);
+    r->committed = (alignment - sizeof(Region))/sizeof(uintptr_t);
+    r->pages = pages;
+    return r;
+}
+
+Region *new_region(size_t capacity)
+{
+    return new_region_pages(capacity, ARENA_PAGES_DEFAULT);
+}
+
+void free_region(Region *r)
+{
+    int ret = munmap(r, sizeof(Region) + sizeof(uintptr_t)*r->capacity);
+    ARENA_ASSERT(ret == 0 && "munmap() failed");
+}
 #elif ARENA_BACKEND == ARENA_BACKEND_WIN32_VIRTUALALLOC
 
 #if !defined(_WIN32)
@@ -117,7 +470,7 @@ Region *new_region(size_t capacity)
         PAGE_READWRITE            /* Permissions ( Read/Write )*/
     );
     if (INV_HANDLE(r))
-        ARENA_ASSERT(0 && "VirtualAllocEx() failed.");
+        return NULL;
 
     r->next = NULL;
     r->count = 0;
@@ -141,56 +494,157 @@ void free_region(Region *r)
         ARENA_ASSERT(0 && "VirtualFreeEx() failed.");
 }
 
+Region *new_region_pages(size_t capacity, Arena_Pages pages)
+{
+    (void)pages;
+    return new_region(capacity);
+}
+
+#define region_commit(r, size) ((void)(r), (void)(size), true)
+#define region_decommit(r, size, resident) ((void)(r), (void)(size), *(resident) = 0, (size_t)0)
+
 #elif ARENA_BACKEND == ARENA_BACKEND_WASM_HEAPBASE
 #  error "TODO: WASM __heap_base backend is not implemented yet"
 #else
 #  error "Unknown Arena backend"
 #endif
 
-// TODO: add debug statistic collection mode for arena
-// Should collect things like:
-// - How many times new_region was called
-// - How many times existing region was skipped
-// - How many times allocation exceeded REGION_DEFAULT_CAPACITY
+#ifdef ARENA_STATS
+#define ARENA_STATS_DO(a, ...) do { Arena_Stats *stats = &(a)->stats; __VA_ARGS__; } while (0)
 
-void *arena_alloc(Arena *a, size_t size_bytes)
+static void arena_stats_new_region(Arena *a, Region *r)
+{
+    ARENA_STATS_DO(a,
+        stats->new_region_calls += 1;
+        stats->regions_count += 1;
+        stats->bytes_reserved += sizeof(Region) + sizeof(uintptr_t)*r->capacity;
+    );
+}
+#else
+#define ARENA_STATS_DO(a, ...) do { (void)(a); } while (0)
+#define arena_stats_new_region(a, r) do { (void)(a); (void)(r); } while (0)
+#endif // ARENA_STATS
+
+// Amount of words to skip in the region so its next allocation is aligned to `align` bytes
+static size_t region_padding(const Region *r, size_t align)
 {
+    uintptr_t p = (uintptr_t)&r->data[r->count];
+    return ((align - p%align)%align)/sizeof(uintptr_t);
+}
+
+static bool region_fits(const Region *r, size_t size, size_t align)
+{
+    return r->count + region_padding(r, align) + size <= r->capacity;
+}
+
+static size_t arena_next_region_capacity(const Region *last, size_t needed)
+{
+    size_t capacity = REGION_DEFAULT_CAPACITY;
+    if (last != NULL) {
+        capacity = last->capacity < ARENA_REGION_MAX_CAPACITY/ARENA_REGION_GROWTH_FACTOR
+            ? last->capacity*ARENA_REGION_GROWTH_FACTOR
+            : ARENA_REGION_MAX_CAPACITY;
+        if (capacity < REGION_DEFAULT_CAPACITY) capacity = REGION_DEFAULT_CAPACITY;
+    }
+    if (capacity < needed) capacity = needed;
+    return capacity;
+}
+
+void *arena_try_alloc_aligned(Arena *a, size_t size_bytes, size_t align)
+{
+    ARENA_ASSERT(align > 0 && (align & (align - 1)) == 0 && "Alignment must be a power of two");
+    if (align < sizeof(uintptr_t)) align = sizeof(uintptr_t);
     size_t size = (size_bytes + sizeof(uintptr_t) - 1)/sizeof(uintptr_t);
+    // Enough room for the worst case padding in a fresh region
+    size_t needed = size + align/sizeof(uintptr_t) - 1;
+
+    ARENA_STATS_DO(a,
+        stats->allocs += 1;
+        stats->bytes_requested += size_bytes;
+        stats->bytes_wasted_alignment += size*sizeof(uintptr_t) - size_bytes;
+        if (size > REGION_DEFAULT_CAPACITY) stats->oversized_allocs += 1;
+    );
 
     if (a->end == NULL) {
         ARENA_ASSERT(a->begin == NULL);
-        size_t capacity = REGION_DEFAULT_CAPACITY;
-        if (capacity < size) capacity = size;
-        a->end = new_region(capacity);
+        Region *r = new_region_pages(arena_next_region_capacity(NULL, needed), a->pages);
+        if (r == NULL) return NULL;
+        a->end = r;
         a->begin = a->end;
+        arena_stats_new_region(a, a->end);
     }
 
-    while (a->end->count + size > a->end->capacity && a->end->next != NULL) {
+    while (!region_fits(a->end, size, align) && a->end->next != NULL) {
+        ARENA_STATS_DO(a,
+            stats->regions_skipped += 1;
+            stats->bytes_wasted_tails += (a->end->capacity - a->end->count)*sizeof(uintptr_t);
+        );
         a->end = a->end->next;
     }
 
-    if (a->end->count + size > a->end->capacity) {
+    if (!region_fits(a->end, size, align)) {
         ARENA_ASSERT(a->end->next == NULL);
-        size_t capacity = REGION_DEFAULT_CAPACITY;
-        if (capacity < size) capacity = size;
-        a->end->next = new_region(capacity);
+        ARENA_STATS_DO(a,
+            stats->regions_skipped += 1;
+            stats->bytes_wasted_tails += (a->end->capacity - a->end->count)*sizeof(uintptr_t);
+        );
+        Region *r = new_region_pages(arena_next_region_capacity(a->end, needed), a->pages);
+        if (r == NULL) return NULL;
+        a->end->next = r;
         a->end = a->end->next;
+        arena_stats_new_region(a, a->end);
     }
 
-    void *result = &a->end->data[a->end->count];
-    a->end->count += size;
+    size_t padding = region_padding(a->end, align);
+    if (!region_commit(a->end, a->end->count + padding + size)) return NULL;
+    void *result = &a->end->data[a->end->count + padding];
+    a->end->count += padding + size;
+    ARENA_STATS_DO(a,
+        stats->bytes_wasted_alignment += padding*sizeof(uintptr_t);
+        stats->bytes_in_use += (padding + size)*sizeof(uintptr_t);
+        if (stats->peak_bytes_in_use < stats->bytes_in_use) stats->peak_bytes_in_use = stats->bytes_in_use;
+    );
+    return result;
+}
+
+void *arena_try_alloc(Arena *a, size_t size_bytes)
+{
+    return arena_try_alloc_aligned(a, size_bytes, sizeof(uintptr_t));
+}
+
+void *arena_alloc_aligned(Arena *a, size_t size_bytes, size_t align)
+{
+    void *result = arena_try_alloc_aligned(a, size_bytes, align);
+    ARENA_ASSERT(result != NULL && "Out of memory");
     return result;
 }
 
+void *arena_alloc(Arena *a, size_t size_bytes)
+{
+    return arena_alloc_aligned(a, size_bytes, sizeof(uintptr_t));
+}
+
+// The most recent allocation is grown in place when its region has room for it
 void *arena_realloc(Arena *a, void *oldptr, size_t oldsz, size_t newsz)
 {
     if (newsz <= oldsz) return oldptr;
-    void *newptr = arena_alloc(a, newsz);
-    char *newptr_char = newptr;
-    char *oldptr_char = oldptr;
-    for (size_t i = 0; i < oldsz; ++i) {
-        newptr_char[i] = oldptr_char[i];
+
+    size_t old_size = (oldsz + sizeof(uintptr_t) - 1)/sizeof(uintptr_t);
+    size_t new_size = (newsz + sizeof(uintptr_t) - 1)/sizeof(uintptr_t);
+    Region *r = a->end;
+    if (oldptr != NULL && r != NULL && (uintptr_t*)oldptr + old_size == &r->data[r->count] && r->count - old_size + new_size <= r->capacity
+        && region_commit(r, r->count - old_size + new_size)) {
+        r->count += new_size - old_size;
+        ARENA_STATS_DO(a,
+            stats->bytes_requested += newsz - oldsz;
+            stats->bytes_in_use += (new_size - old_size)*sizeof(uintptr_t);
+            if (stats->peak_bytes_in_use < stats->bytes_in_use) stats->peak_bytes_in_use = stats->bytes_in_use;
+        );
+        return oldptr;
     }
+
+    void *newptr = arena_alloc(a, newsz);
+    if (oldsz > 0) memcpy(newptr, oldptr, oldsz);
     return newptr;
 }
 
@@ -219,6 +673,7 @@ void arena_reset(Arena *a)
     }
 
     a->end = a->begin;
+    ARENA_STATS_DO(a, stats->bytes_in_use = 0);
 }
 
 void arena_free(Arena *a)
@@ -231,6 +686,208 @@ void arena_free(Arena *a)
     }
     a->begin = NULL;
     a->end = NULL;
+    ARENA_STATS_DO(a,
+        stats->bytes_in_use = 0;
+        stats->regions_count = 0;
+        stats->bytes_reserved = 0;
+    );
+}
+
+size_t arena_used_bytes(const Arena *a)
+{
+    if (a->end == NULL) return 0;
+    size_t used = 0;
+    for (Region *r = a->begin; r != a->end; r = r->next) {
+        used += sizeof(uintptr_t)*r->capacity;
+    }
+    return used + sizeof(uintptr_t)*a->end->count;
+}
+
+void arena_trim(Arena *a, size_t retain_bytes)
+{
+    if (a->end == NULL) return;
+
+    size_t kept = 0;
+    for (Region *r = a->begin; r != a->end; r = r->next) {
+        kept += sizeof(uintptr_t)*r->capacity;
+    }
+    size_t retain = retain_bytes > kept ? (retain_bytes - kept)/sizeof(uintptr_t) : 0;
+    size_t resident = 0;
+    size_t decommitted = region_decommit(a->end, a->end->count > retain ? a->end->count : retain, &resident);
+    (void)decommitted;
+    ARENA_STATS_DO(a,
+        stats->bytes_trimmed += decommitted;
+        stats->bytes_rss_reclaimed += resident;
+    );
+    kept += sizeof(uintptr_t)*a->end->capacity;
+
+    Region *last = a->end;
+    while (last->next != NULL && kept < retain_bytes) {
+        last = last->next;
+        kept += sizeof(uintptr_t)*last->capacity;
+    }
+    Region *r = last->next;
+    last->next = NULL;
+    while (r != NULL) {
+        Region *r0 = r;
+        r = r->next;
+        ARENA_STATS_DO(a,
+            stats->regions_count -= 1;
+            stats->bytes_reserved -= sizeof(Region) + sizeof(uintptr_t)*r0->capacity;
+            stats->bytes_trimmed += sizeof(Region) + sizeof(uintptr_t)*r0->capacity;
+        );
+        free_region(r0);
+    }
+}
+
+void arena_reset_decommit(Arena *a, size_t threshold_bytes)
+{
+    size_t kept = 0;
+    for (Region *r = a->begin; r != NULL; r = r->next) {
+        size_t keep = threshold_bytes > kept ? (threshold_bytes - kept)/sizeof(uintptr_t) : 0;
+        size_t resident = 0;
+        size_t decommitted = region_decommit(r, keep, &resident);
+        (void)decommitted;
+        ARENA_STATS_DO(a,
+            stats->bytes_trimmed += decommitted;
+            stats->bytes_rss_reclaimed += resident;
+        );
+        kept += sizeof(uintptr_t)*r->capacity;
+    }
+    arena_reset(a);
+}
+
+Arena_Mark arena_snapshot(Arena *a)
+{
+    Arena_Mark m = {0};
+    if (a->end != NULL) {
+        m.region = a->end;
+        m.count = a->end->count;
+    }
+    ARENA_STATS_DO(a, m.bytes_in_use = stats->bytes_in_use);
+    return m;
+}
+
+// Only the regions between the marked one and a->end can be in use past the mark, the ones
+// after a->end are already empty. The mark must not be older than the last reset of the arena.
+void arena_rewind(Arena *a, Arena_Mark m)
+{
+    if (m.region == NULL) {
+        arena_reset(a);
+        return;
+    }
+    for (Region *r = m.region; r != a->end;) {
+        ARENA_ASSERT(r->next != NULL && "The mark does not belong to the arena");
+        r = r->next;
+        r->count = 0;
+    }
+    m.region->count = m.count;
+    a->end = m.region;
+    ARENA_STATS_DO(a, stats->bytes_in_use = m.bytes_in_use);
+}
+
+void pool_init(Pool *p, size_t object_size, size_t align)
+{
+    memset(p, 0, sizeof(*p));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_mutex_init(&p->slab_lock, NULL);
+    if (align < sizeof(Pool_Object)) align = sizeof(Pool_Object);
+    ARENA_ASSERT((align & (align - 1)) == 0 && "Alignment must be a power of two");
+    if (object_size < sizeof(Pool_Object)) object_size = sizeof(Pool_Object);
+    p->object_size = (object_size + align - 1)/align*align;
+    p->align = align;
+}
+
+void *pool_alloc(Pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    Pool_Object *object = p->free_list;
+    if (object != NULL) {
+        p->free_list = object->next;
+#ifdef ARENA_STATS
+        p->stats.allocs += 1;
+        p->stats.live += 1;
+        if (p->stats.peak_live < p->stats.live) p->stats.peak_live = p->stats.live;
+#endif // ARENA_STATS
+        pthread_mutex_unlock(&p->lock);
+        return object;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    // Several threads may run out at once and add a slab each, which is fine
+    pthread_mutex_lock(&p->slab_lock);
+    char *slab = arena_try_alloc_aligned(&p->arena, p->object_size*POOL_SLAB_OBJECTS, p->align);
+    pthread_mutex_unlock(&p->slab_lock);
+    if (slab == NULL) return NULL;
+
+    // The first object is the result, the rest go to the free list
+    Pool_Object *first = (Pool_Object*)(slab + p->object_size);
+    Pool_Object *last = first;
+    for (size_t i = 2; i < POOL_SLAB_OBJECTS; ++i) {
+        last->next = (Pool_Object*)(slab + i*p->object_size);
+        last = last->next;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    last->next = p->free_list;
+    p->free_list = first;
+#ifdef ARENA_STATS
+    p->stats.slabs += 1;
+    p->stats.allocs += 1;
+    p->stats.live += 1;
+    if (p->stats.peak_live < p->stats.live) p->stats.peak_live = p->stats.live;
+#endif // ARENA_STATS
+    pthread_mutex_unlock(&p->lock);
+    return slab;
+}
+
+void pool_free(Pool *p, void *ptr)
+{
+    if (ptr == NULL) return;
+    Pool_Object *object = ptr;
+    pthread_mutex_lock(&p->lock);
+    object->next = p->free_list;
+    p->free_list = object;
+#ifdef ARENA_STATS
+    p->stats.frees += 1;
+    p->stats.live -= 1;
+#endif // ARENA_STATS
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_destroy(Pool *p)
+{
+    arena_free(&p->arena);
+    p->free_list = NULL;
+    pthread_mutex_destroy(&p->lock);
+    pthread_mutex_destroy(&p->slab_lock);
+}
+
+#ifdef ARENA_STATS
+void pool_stats_dump(const Pool *p, const char *name, FILE *stream)
+{
+    const Pool_Stats *stats = &p->stats;
+    fprintf(stream, "Pool %s (%zu byte objects):\n", name, p->object_size);
+    fprintf(stream, "  allocs:             %zu\n", stats->allocs);
+    fprintf(stream, "  frees:              %zu\n", stats->frees);
+    fprintf(stream, "  live:               %zu (peak %zu)\n", stats->live, stats->peak_live);
+    fprintf(stream, "  slabs:              %zu (%zu objects)\n", stats->slabs, stats->slabs*POOL_SLAB_OBJECTS);
+}
+
+void arena_stats_dump(const Arena *a, const char *name, FILE *stream)
+{
+    const Arena_Stats *stats = &a->stats;
+    fprintf(stream, "Arena %s:\n", name);
+    fprintf(stream, "  allocs:             %zu (%zu oversized)\n", stats->allocs, stats->oversized_allocs);
+    fprintf(stream, "  bytes requested:    %zu\n", stats->bytes_requested);
+    fprintf(stream, "  wasted (alignment): %zu bytes\n", stats->bytes_wasted_alignment);
+    fprintf(stream, "  wasted (tails):     %zu bytes\n", stats->bytes_wasted_tails);
+    fprintf(stream, "  in use:             %zu bytes (peak %zu)\n", stats->bytes_in_use, stats->peak_bytes_in_use);
+    fprintf(stream, "  regions:            %zu (%zu bytes), new_region called %zu times, skipped %zu times\n",
+            stats->regions_count, stats->bytes_reserved, stats->new_region_calls, stats->regions_skipped);
+    fprintf(stream, "  trimmed:            %zu bytes\n", stats->bytes_trimmed);
+    fprintf(stream, "  RSS reclaimed:      %zu bytes\n", stats->bytes_rss_reclaimed);
 }
+#endif // ARENA_STATS
 
 #endif // ARENA_IMPLEMENTATION
@@ -1,39 +1,384 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <ctype.h>
 #include <zlib.h>
 
 #include <sys/sysinfo.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 #define NOB_IMPLEMENTATION
 #include "nob.h"
 #define ARENA_IMPLEMENTATION
+#define ARENA_BACKEND ARENA_BACKEND_LINUX_MMAP
 #include "arena.h"
 
 #define K 2
+// Scratch arenas of the long-running modes give back the memory above this after a request
+#define SCRATCH_ARENA_RETAIN (1024*1024)
+#define DEFAULT_REFINE 100
+
+double clock_get_secs(void)
+{
+    struct timespec ts = {0};
+    int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+    assert(ret == 0);
+    return (double)ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// The number of CPUs granted by the cgroup v2 cpu.max quotas of the current process and all of its
+// ancestor cgroups, or 0 if there is no quota (or no cgroup v2 at all)
+size_t cgroup_cpu_quota(void)
+{
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL) return 0;
+    char line[4096];
+    Nob_String_View cgroup = {0};
+    while (fgets(line, sizeof(line), f)) {
+        Nob_String_View sv = nob_sv_trim(nob_sv_from_cstr(line));
+        if (sv.count >= 3 && memcmp(sv.data, "0::", 3) == 0) {
+            cgroup = nob_sv_from_parts(sv.data + 3, sv.count - 3);
+            break;
+        }
+    }
+    fclose(f);
+    if (cgroup.data == NULL) return 0;
+
+    size_t temp_checkpoint = nob_temp_save();
+    char *dir = nob_temp_sprintf("/sys/fs/cgroup"SV_Fmt, SV_Arg(cgroup));
+    size_t root_len = strlen("/sys/fs/cgroup");
+    size_t quota_cpus = 0;
+    while (true) {
+        f = fopen(nob_temp_sprintf("%s/cpu.max", dir), "r");
+        if (f != NULL) {
+            char quota[64];
+            unsigned long long period = 0;
+            if (fscanf(f, "%63s %llu", quota, &period) == 2 && strcmp(quota, "max") != 0 && period > 0) {
+                size_t n = (strtoull(quota, NULL, 10) + period - 1)/period;
+                if (n == 0) n = 1;
+                if (quota_cpus == 0 || n < quota_cpus) quota_cpus = n;
+            }
+            fclose(f);
+        }
+
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL || (size_t)(slash - dir) < root_len) break;
+        *slash = '\0';
+    }
+    nob_temp_rewind(temp_checkpoint);
+    return quota_cpus;
+}
+
+typedef struct {
+    int *items;
+    size_t count;
+    size_t capacity;
+} Cpus;
+
+// Collects the CPUs the process is allowed to run on into `cpus` and returns how many
+// workers should be started: the affinity mask size capped by the cgroup CPU quota
+size_t available_cpus(Cpus *cpus)
+{
+    cpus->count = 0;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) nob_da_append(cpus, cpu);
+        }
+    } else {
+        nob_log(NOB_WARNING, "Could not get CPU affinity of the process: %s", strerror(errno));
+    }
+
+    size_t n = cpus->count > 0 ? cpus->count : (size_t)get_nprocs();
+    size_t quota = cgroup_cpu_quota();
+    if (quota > 0 && quota < n) n = quota;
+    return n;
+}
+
+static voidpf deflate_arena_alloc(voidpf opaque, uInt items, uInt size)
+{
+    return arena_try_alloc(opaque, (size_t)items*size);
+}
+
+static void deflate_arena_free(voidpf opaque, voidpf address)
+{
+    (void)opaque;
+    (void)address;
+}
 
 // Stolen from https://gist.github.com/arq5x/5315739
-Nob_String_View deflate_sv(Arena *arena, Nob_String_View sv)
+//
+// The state of the deflate stream lives in the arena and is rewound right away. Going through
+// malloc() instead made glibc trim the top of the heap after every deflateEnd(), which turned
+// into a pair of syscalls per ncd() once the arenas themselves stopped living on that heap.
+Nob_String_View deflate_sv(Arena *arena, Nob_String_View sv, int level)
 {
-    size_t output_size = sv.count*2;
+    // deflateBound() without a stream gives the bound for the default parameters, which is
+    // the most conservative one
+    size_t output_size = deflateBound(NULL, sv.count);
     void *output = arena_alloc(arena, output_size);
 
+    Arena_Mark mark = arena_snapshot(arena);
     z_stream defstream = {0};
+    defstream.zalloc = deflate_arena_alloc;
+    defstream.zfree = deflate_arena_free;
+    defstream.opaque = arena;
+    int ret = deflateInit(&defstream, level);
+    if (ret != Z_OK) {
+        // The level is validated when the flags are parsed, so this is either Z_MEM_ERROR or a bug
+        nob_log(NOB_ERROR, "Could not initialize deflate with level %d: %s", level, zError(ret));
+        abort();
+    }
+
     defstream.avail_in = (uInt)sv.count;
     defstream.next_in = (Bytef *)sv.data;
     defstream.avail_out = (uInt)output_size;
     defstream.next_out = (Bytef *)output;
 
-    deflateInit(&defstream, Z_BEST_COMPRESSION);
     int result = deflate(&defstream, Z_FINISH);
     assert(result == Z_STREAM_END && "Probably not enough output buffer was allocated");
     deflateEnd(&defstream);
+    arena_rewind(arena, mark);
 
     return nob_sv_from_parts(output, defstream.total_out);
 }
 
+size_t zlib_compressed_size(Arena *arena, Nob_String_View sv, int level)
+{
+    return deflate_sv(arena, sv, level).count;
+}
+
+#define LZ77_WINDOW_SIZE 32768
+#define LZ77_MIN_MATCH 3
+#define LZ77_MAX_MATCH 258
+#define LZ77_LITLEN_SYMBOLS 286
+#define LZ77_DIST_SYMBOLS 30
+#define LZ77_END_OF_BLOCK 256
+// The level of the estimator is the log2 of the maximum hash chain depth
+#define LZ77_MAX_LEVEL 12
+
+static const uint16_t lz77_length_base[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t lz77_length_extra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t lz77_dist_base[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t lz77_dist_extra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static size_t lz77_code(const uint16_t *base, size_t base_count, size_t value)
+{
+    size_t code = 0;
+    while (code + 1 < base_count && base[code + 1] <= value) code += 1;
+    return code;
+}
+
+// Incrementally maintained price of a stream of LZ77 symbols: either the fixed Huffman codes or
+// the Shannon entropy of the symbols plus a rough cost of transmitting the dynamic code tables,
+// whichever is cheaper, the same way deflate picks the block type. The entropy of the alphabets
+// is kept as T*log2(T) - sum(f*log2(f)) with the running sum updated on every frequency change,
+// so the price is known in O(1) after every added symbol.
+typedef struct {
+    uint32_t litlen_freq[LZ77_LITLEN_SYMBOLS];
+    uint32_t dist_freq[LZ77_DIST_SYMBOLS];
+    double litlen_flogf;
+    double dist_flogf;
+    uint32_t litlen_total;
+    uint32_t dist_total;
+    uint16_t litlen_used;
+    uint16_t dist_used;
+    uint32_t fixed_bits;
+    uint32_t extra_bits;
+} Lz77_Cost;
+
+static double flog2(double x)
+{
+    return x > 0 ? x*log2(x) : 0;
+}
+
+// flog2(f + 1) - flog2(f) for the small frequencies, which are the vast majority
+#define LZ77_FLOG2_DELTAS 4096
+static double lz77_flog2_deltas[LZ77_FLOG2_DELTAS];
+static pthread_once_t lz77_flog2_deltas_once = PTHREAD_ONCE_INIT;
+
+static void lz77_flog2_deltas_init(void)
+{
+    for (size_t f = 0; f < LZ77_FLOG2_DELTAS; ++f) lz77_flog2_deltas[f] = flog2(f + 1) - flog2(f);
+}
+
+static inline double lz77_flog2_delta(uint32_t f)
+{
+    return f < LZ77_FLOG2_DELTAS ? lz77_flog2_deltas[f] : flog2(f + 1) - flog2(f);
+}
+
+static void lz77_cost_litlen(Lz77_Cost *c, size_t symbol)
+{
+    uint32_t f = c->litlen_freq[symbol]++;
+    c->litlen_flogf += lz77_flog2_delta(f);
+    c->litlen_total += 1;
+    if (f == 0) c->litlen_used += 1;
+    c->fixed_bits += symbol < 144 ? 8 : symbol < 256 ? 9 : symbol < 280 ? 7 : 8;
+}
+
+void lz77_cost_init(Lz77_Cost *c)
+{
+    pthread_once(&lz77_flog2_deltas_once, lz77_flog2_deltas_init);
+    memset(c, 0, sizeof(*c));
+    lz77_cost_litlen(c, LZ77_END_OF_BLOCK);
+}
+
+void lz77_cost_literal(Lz77_Cost *c, uint8_t byte)
+{
+    lz77_cost_litlen(c, byte);
+}
+
+void lz77_cost_match(Lz77_Cost *c, size_t len, size_t dist)
+{
+    size_t lc = lz77_code(lz77_length_base, NOB_ARRAY_LEN(lz77_length_base), len);
+    size_t dc = lz77_code(lz77_dist_base, NOB_ARRAY_LEN(lz77_dist_base), dist);
+    lz77_cost_litlen(c, 257 + lc);
+    uint32_t f = c->dist_freq[dc]++;
+    c->dist_flogf += lz77_flog2_delta(f);
+    c->dist_total += 1;
+    if (f == 0) c->dist_used += 1;
+    c->fixed_bits += 5;
+    c->extra_bits += lz77_length_extra[lc] + lz77_dist_extra[dc];
+}
+
+size_t lz77_cost_size(const Lz77_Cost *c)
+{
+    double dynamic_bits = flog2(c->litlen_total) - c->litlen_flogf + flog2(c->dist_total) - c->dist_flogf;
+    // HLIT, HDIST, HCLEN and the code length code itself, then roughly 4 bits per used code length
+    dynamic_bits += 14 + 19*3 + 4*(c->litlen_used + c->dist_used);
+    size_t block_bits = 3 + c->extra_bits;
+    if (dynamic_bits < c->fixed_bits) block_bits += (size_t)dynamic_bits;
+    else block_bits += c->fixed_bits;
+    // zlib header and the adler32 trailer
+    return 2 + (block_bits + 7)/8 + 4;
+}
+
+// Estimates the size of deflate_sv(sv).count without producing any output.
+//
+// Runs greedy LZ77 with hash chains over the deflate window and prices the resulting symbols
+// with Lz77_Cost. `level` is the log2 of the maximum hash chain depth. Only the positions that
+// really share the first LZ77_MIN_MATCH bytes count towards the depth, so the parse does not
+// depend on the size of the hash table (the type-ahead states rely on that, see Typeahead_State).
+size_t lz77_compressed_size(Arena *arena, Nob_String_View sv, int level)
+{
+    const uint8_t *data = (const uint8_t *)sv.data;
+    size_t n = sv.count;
+
+    size_t hash_size = 64;
+    while (hash_size < n && hash_size < LZ77_WINDOW_SIZE) hash_size *= 2;
+    int32_t *head = arena_alloc(arena, hash_size*sizeof(*head));
+    int32_t *prev = arena_alloc(arena, (n + 1)*sizeof(*prev));
+    memset(head, 0xFF, hash_size*sizeof(*head));
+
+    Lz77_Cost cost;
+    lz77_cost_init(&cost);
+    size_t max_chain = (size_t)1 << (level < 0 ? 0 : level > LZ77_MAX_LEVEL ? LZ77_MAX_LEVEL : level);
+
+#define LZ77_HASH(i) ((((uint32_t)data[(i)] << 16) ^ ((uint32_t)data[(i) + 1] << 8) ^ data[(i) + 2])*2654435761u >> 8 & (hash_size - 1))
+#define LZ77_INSERT(i) do { \
+        if ((i) + LZ77_MIN_MATCH <= n) { \
+            uint32_t h = LZ77_HASH(i); \
+            prev[(i)] = head[h]; \
+            head[h] = (int32_t)(i); \
+        } \
+    } while (0)
+
+    size_t i = 0;
+    while (i < n) {
+        size_t best_len = 0;
+        size_t best_dist = 0;
+        if (i + LZ77_MIN_MATCH <= n) {
+            size_t max_len = n - i;
+            if (max_len > LZ77_MAX_MATCH) max_len = LZ77_MAX_MATCH;
+            int32_t j = head[LZ77_HASH(i)];
+            for (size_t chain = 0; j >= 0 && chain < max_chain && i - j <= LZ77_WINDOW_SIZE; j = prev[j]) {
+                if (data[j] != data[i] || data[j + 1] != data[i + 1] || data[j + 2] != data[i + 2]) continue;
+                chain += 1;
+                if (data[j + best_len] != data[i + best_len]) continue;
+                size_t len = 0;
+                while (len < max_len && data[j + len] == data[i + len]) len += 1;
+                if (len > best_len) {
+                    best_len = len;
+                    best_dist = i - j;
+                    if (len == max_len) break;
+                }
+            }
+        }
+
+        if (best_len >= LZ77_MIN_MATCH) {
+            lz77_cost_match(&cost, best_len, best_dist);
+            for (size_t end = i + best_len; i < end; ++i) LZ77_INSERT(i);
+        } else {
+            lz77_cost_literal(&cost, data[i]);
+            LZ77_INSERT(i);
+            i += 1;
+        }
+    }
+
+#undef LZ77_INSERT
+#undef LZ77_HASH
+
+    return lz77_cost_size(&cost);
+}
+
+typedef struct {
+    const char *name;
+    size_t (*compressed_size)(Arena *arena, Nob_String_View sv, int level);
+    int level;
+    int min_level, max_level;
+} Compressor;
+
+Compressor compressors[] = {
+    {
+        .name = "zlib",
+        .compressed_size = zlib_compressed_size,
+        .level = Z_BEST_COMPRESSION,
+        .min_level = Z_NO_COMPRESSION,
+        .max_level = Z_BEST_COMPRESSION,
+    },
+    {
+        .name = "lz77",
+        .compressed_size = lz77_compressed_size,
+        .level = 4,
+        .min_level = 0,
+        .max_level = LZ77_MAX_LEVEL,
+    },
+};
+
+Compressor *find_compressor(const char *name)
+{
+    for (size_t i = 0; i < NOB_ARRAY_LEN(compressors); ++i) {
+        if (strcmp(compressors[i].name, name) == 0) return &compressors[i];
+    }
+    return NULL;
+}
+
 typedef struct {
     size_t klass;
     Nob_String_View text;
+    // Compressed size of the text. Only known for the samples of Klass_Predictor.
+    float size;
+    // Compressed size of the first Klass_Predictor.prefix bytes of the text. Only known for the
+    // samples of Klass_Predictor with the prefix tier enabled.
+    float prefix_size;
 } Sample;
 
 typedef struct {
@@ -42,202 +387,2990 @@ typedef struct {
     size_t capacity;
 } Samples;
 
+// Parses a single CSV record "<class index>,<text>"
+Sample parse_sample(Nob_String_View line)
+{
+    Nob_String_View klass = nob_sv_chop_by_delim(&line, ',');
+    size_t klass_index = *klass.data - '0' - 1;
+    return (Sample) {
+        .klass = klass_index,
+        .text = line,
+    };
+}
+
+// Index of the newline ending the CSV record that starts at data[0] or count if there is none.
+// The newlines inside of the quoted fields do not end the record.
+size_t record_end(const char *data, size_t count)
+{
+    bool quoted = false;
+    for (size_t i = 0; i < count; ++i) {
+        if (data[i] == '"') quoted = !quoted;
+        else if (data[i] == '\n' && !quoted) return i;
+    }
+    return count;
+}
+
+Nob_String_View chop_record(Nob_String_View *content)
+{
+    size_t end = record_end(content->data, content->count);
+    Nob_String_View record = nob_sv_from_parts(content->data, end);
+    if (end < content->count) end += 1;
+    content->data += end;
+    content->count -= end;
+    return record;
+}
+
 Samples parse_samples(Nob_String_View content)
 {
     size_t lines_count = 0;
     Samples samples = {0};
     for (; content.count > 0; ++lines_count) {
-        Nob_String_View line = nob_sv_chop_by_delim(&content, '\n');
+        Nob_String_View line = chop_record(&content);
         if (lines_count == 0) continue; // ignore the header
-
-        Nob_String_View klass = nob_sv_chop_by_delim(&line, ',');
-        size_t klass_index = *klass.data - '0' - 1;
-
-        nob_da_append(&samples, ((Sample) {
-            .klass = klass_index,
-            .text = line,
-        }));
+        nob_da_append(&samples, parse_sample(line));
     }
     return samples;
 }
 
-const char *klass_names[] = {"World", "Sports", "Business", "Sci/Tech"};
-
-typedef struct {
-    float distance;
-    size_t klass;
-} NCD;
+// Parallel version of parse_samples() for big files. The content is split into per thread
+// chunks and each thread parses the records starting within its chunk. Whether a chunk starts
+// inside of a quoted field is found from the amounts of quotes in all the preceding chunks,
+// which are counted in parallel beforehand.
+#define PARALLEL_PARSE_MIN_SIZE (1024*1024)
 
 typedef struct {
-    NCD *items;
-    size_t count;
-    size_t capacity;
-} NCDs;
+    Nob_String_View content;
+    size_t begin;
+    size_t end;
+    size_t quotes;
+    bool quoted;
+    Samples samples;
+    Arena arena;
+} Parse_Job;
 
-float ncd(Arena *arena, Nob_String_View a, Nob_String_View b, float cb)
+void *count_quotes_thread(void *params)
 {
-    Nob_String_View ab = nob_sv_from_cstr(arena_sprintf(arena, SV_Fmt" "SV_Fmt, SV_Arg(a), SV_Arg(b)));
-    float ca = deflate_sv(arena, a).count;
-    float cab = deflate_sv(arena, ab).count;
-    float mn = ca; if (mn > cb) mn = cb;
-    float mx = ca; if (mx < cb) mx = cb;
-    return (cab - mn)/mx;
+    Parse_Job *job = params;
+    size_t quotes = 0;
+    for (size_t i = job->begin; i < job->end; ++i) {
+        quotes += job->content.data[i] == '"';
+    }
+    job->quotes = quotes;
+    return NULL;
 }
 
-int compare_ncds(const void *a, const void *b)
+void *parse_chunk_thread(void *params)
 {
-    const NCD *na = a;
-    const NCD *nb = b;
-    if (na->distance < nb->distance) return -1;
-    if (na->distance > nb->distance) return 1;
-    return 0;
-}
+    Parse_Job *job = params;
+    const char *data = job->content.data;
+    size_t start = job->begin;
+    if (start == 0) {
+        // ignore the header
+        start = record_end(data, job->content.count);
+        if (start < job->content.count) start += 1;
+    } else if (!(data[start - 1] == '\n' && !job->quoted)) {
+        bool quoted = job->quoted;
+        while (start < job->end && (data[start] != '\n' || quoted)) {
+            if (data[start] == '"') quoted = !quoted;
+            start += 1;
+        }
+        start += 1;
+    }
 
-typedef struct {
-    Sample *train;
-    size_t train_count;
-    Nob_String_View text;
+    while (start < job->end && start < job->content.count) {
+        size_t end = start + record_end(data + start, job->content.count - start);
+        arena_da_append(&job->arena, &job->samples, parse_sample(nob_sv_from_parts(data + start, end - start)));
+        start = end + 1;
+    }
+    return NULL;
+}
 
-    NCDs ncds;
-    Arena arena;
-} Klassify_State;
+static void run_parse_jobs(Parse_Job *jobs, size_t nprocs, void *(*thread)(void*))
+{
+    pthread_t *threads = malloc(nprocs*sizeof(*threads));
+    assert(threads != NULL);
+    for (size_t i = 0; i < nprocs; ++i) {
+        if (pthread_create(&threads[i], NULL, thread, &jobs[i]) != 0) {
+            nob_log(NOB_ERROR, "Could not create thread");
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < nprocs; ++i) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            nob_log(NOB_ERROR, "Could not join thread");
+            exit(1);
+        }
+    }
+    free(threads);
+}
 
-void *klassify_thread(void *params)
+Samples parse_samples_parallel(Nob_String_View content, size_t nprocs)
 {
-    Klassify_State *state = params;
+    if (nprocs <= 1 || content.count < PARALLEL_PARSE_MIN_SIZE) return parse_samples(content);
 
-    float cb = deflate_sv(&state->arena, state->text).count;
-    for (size_t i = 0; i < state->train_count; ++i) {
-        float distance = ncd(&state->arena, state->train[i].text, state->text, cb);
-        arena_reset(&state->arena);
-        nob_da_append(&state->ncds, ((NCD) {
-            .distance = distance,
-            .klass = state->train[i].klass,
-        }));
+    Parse_Job *jobs = calloc(nprocs, sizeof(*jobs));
+    assert(jobs != NULL);
+    for (size_t i = 0; i < nprocs; ++i) {
+        jobs[i].content = content;
+        jobs[i].begin = content.count*i/nprocs;
+        jobs[i].end = content.count*(i + 1)/nprocs;
+    }
+    run_parse_jobs(jobs, nprocs, count_quotes_thread);
+    size_t quotes = 0;
+    for (size_t i = 0; i < nprocs; ++i) {
+        jobs[i].quoted = quotes%2 == 1;
+        quotes += jobs[i].quotes;
     }
+    run_parse_jobs(jobs, nprocs, parse_chunk_thread);
 
-    return NULL;
+    Samples samples = {0};
+    for (size_t i = 0; i < nprocs; ++i) {
+        nob_da_append_many(&samples, jobs[i].samples.items, jobs[i].samples.count);
+        arena_free(&jobs[i].arena);
+    }
+    free(jobs);
+    return samples;
 }
 
-typedef struct {
-    size_t nprocs;
-    size_t chunk_size;
-    size_t chunk_rem;
+// Streaming loader for the gzip compressed CSV files. The inflate thread reads the compressed
+// file in big blocks and inflates it into chunks handed over through a bounded queue, while
+// the loading thread appends them to the content and parses the complete lines as they come.
+#define GZIP_READ_AHEAD (4*1024*1024)
+#define GZIP_CHUNK_SIZE (1024*1024)
+#define GZIP_QUEUE_CAPACITY 8
 
-    Samples train_samples;
+typedef struct {
+    char *data;
+    size_t count;
+} Inflate_Chunk;
 
-    pthread_t *threads;
-    Klassify_State *states;
+typedef struct {
+    const char *path;
+    FILE *f;
 
-    NCDs ncds;
-} Klass_Predictor;
+    Inflate_Chunk queue[GZIP_QUEUE_CAPACITY];
+    size_t queue_begin;
+    size_t queue_count;
+    bool done;
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Inflate_Stream;
 
-void klass_predictor_init(Klass_Predictor *kp, Samples train_samples)
+static void inflate_stream_push(Inflate_Stream *is, Inflate_Chunk chunk)
 {
-    kp->nprocs = get_nprocs();
-    kp->chunk_size = train_samples.count/kp->nprocs;
-    kp->chunk_rem = train_samples.count%kp->nprocs;
-    kp->train_samples = train_samples;
+    pthread_mutex_lock(&is->lock);
+    while (is->queue_count == GZIP_QUEUE_CAPACITY) pthread_cond_wait(&is->cond, &is->lock);
+    is->queue[(is->queue_begin + is->queue_count)%GZIP_QUEUE_CAPACITY] = chunk;
+    is->queue_count += 1;
+    pthread_cond_broadcast(&is->cond);
+    pthread_mutex_unlock(&is->lock);
+}
 
-    kp->threads = malloc(kp->nprocs*sizeof(pthread_t));
-    assert(kp->threads != NULL);
-    memset(kp->threads, 0, kp->nprocs*sizeof(pthread_t));
-    kp->states = malloc(kp->nprocs*sizeof(Klassify_State));
-    assert(kp->states != NULL);
-    memset(kp->states, 0, kp->nprocs*sizeof(Klassify_State));
+static void inflate_stream_finish(Inflate_Stream *is, bool failed)
+{
+    pthread_mutex_lock(&is->lock);
+    is->done = true;
+    is->failed = failed;
+    pthread_cond_broadcast(&is->cond);
+    pthread_mutex_unlock(&is->lock);
 }
 
-size_t klass_predictor_predict(Klass_Predictor *kp, Nob_String_View text, size_t k)
+// Returns false when the stream is over
+static bool inflate_stream_pop(Inflate_Stream *is, Inflate_Chunk *chunk)
 {
-    for (size_t i = 0; i < kp->nprocs; ++i) {
-        kp->states[i].train = kp->train_samples.items + i*kp->chunk_size;
-        kp->states[i].train_count = kp->chunk_size;
-        if (i == kp->nprocs - 1) kp->states[i].train_count += kp->chunk_rem;
-        kp->states[i].text = text;
-        kp->states[i].ncds.count = 0;
-        arena_reset(&kp->states[i].arena);
-        if (pthread_create(&kp->threads[i], NULL, klassify_thread, &kp->states[i]) != 0) {
-            nob_log(NOB_ERROR, "Could not create thread");
-            exit(1);
-        }
+    pthread_mutex_lock(&is->lock);
+    while (is->queue_count == 0 && !is->done) pthread_cond_wait(&is->cond, &is->lock);
+    bool result = is->queue_count > 0;
+    if (result) {
+        *chunk = is->queue[is->queue_begin];
+        is->queue_begin = (is->queue_begin + 1)%GZIP_QUEUE_CAPACITY;
+        is->queue_count -= 1;
+        pthread_cond_broadcast(&is->cond);
     }
+    pthread_mutex_unlock(&is->lock);
+    return result;
+}
 
-    kp->ncds.count = 0;
-    for (size_t i = 0; i < kp->nprocs; ++i) {
-        if (pthread_join(kp->threads[i], NULL) != 0) {
-            nob_log(NOB_ERROR, "Could not join thread");
-            exit(1);
+void *inflate_thread(void *params)
+{
+    Inflate_Stream *is = params;
+    unsigned char *input = malloc(GZIP_READ_AHEAD);
+    assert(input != NULL);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fileno(is->f), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    z_stream strm = {0};
+    // 16 enables the gzip wrapper
+    int ret = inflateInit2(&strm, 16 + MAX_WBITS);
+    assert(ret == Z_OK);
+
+    bool failed = false;
+    Inflate_Chunk chunk = {0};
+    ret = Z_OK;
+    while (!failed) {
+        if (strm.avail_in == 0) {
+            strm.avail_in = fread(input, 1, GZIP_READ_AHEAD, is->f);
+            strm.next_in = input;
+            if (ferror(is->f)) {
+                nob_log(NOB_ERROR, "Could not read file %s: %s", is->path, strerror(errno));
+                failed = true;
+                break;
+            }
+            if (strm.avail_in == 0) {
+                if (ret != Z_STREAM_END) {
+                    nob_log(NOB_ERROR, "Unexpected end of gzip file %s", is->path);
+                    failed = true;
+                }
+                break;
+            }
         }
-        nob_da_append_many(&kp->ncds, kp->states[i].ncds.items, kp->states[i].ncds.count);
-    }
-    qsort(kp->ncds.items, kp->ncds.count, sizeof(*kp->ncds.items), compare_ncds);
 
-    size_t klass_freq[NOB_ARRAY_LEN(klass_names)] = {0};
-    for (size_t i = 0; i < k && i < kp->ncds.count; ++i) {
-        klass_freq[kp->ncds.items[i].klass] += 1;
-    }
+        // Concatenated gzip members are allowed
+        if (ret == Z_STREAM_END) inflateReset(&strm);
 
-    size_t predicted_klass = 0;
-    for (size_t i = 1; i < NOB_ARRAY_LEN(klass_names); ++i) {
-        if (klass_freq[predicted_klass] < klass_freq[i]) {
-            predicted_klass = i;
+        if (chunk.data == NULL) {
+            chunk.data = malloc(GZIP_CHUNK_SIZE);
+            assert(chunk.data != NULL);
+            chunk.count = 0;
+        }
+        strm.next_out = (Bytef *)chunk.data + chunk.count;
+        strm.avail_out = GZIP_CHUNK_SIZE - chunk.count;
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            nob_log(NOB_ERROR, "Could not inflate file %s: %s", is->path, strm.msg ? strm.msg : "corrupted data");
+            failed = true;
+            break;
         }
+        chunk.count = GZIP_CHUNK_SIZE - strm.avail_out;
+        if (chunk.count == GZIP_CHUNK_SIZE) {
+            inflate_stream_push(is, chunk);
+            chunk.data = NULL;
+        }
+    }
+    if (!failed && chunk.data != NULL && chunk.count > 0) {
+        inflate_stream_push(is, chunk);
+    } else {
+        free(chunk.data);
     }
 
-    return predicted_klass;
+    inflateEnd(&strm);
+    free(input);
+    inflate_stream_finish(is, failed);
+    return NULL;
 }
 
-char buffer[512];
+typedef struct {
+    size_t klass;
+    size_t offset;
+    size_t count;
+} Sample_Span;
 
-double clock_get_secs(void)
-{
-    struct timespec ts = {0};
-    int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
-    assert(ret == 0);
-    return (double)ts.tv_sec + ts.tv_nsec*1e-9;
-}
+typedef struct {
+    Sample_Span *items;
+    size_t count;
+    size_t capacity;
+} Sample_Spans;
 
-void usage(const char *program)
+bool load_gzip_samples(const char *path, FILE *f, Nob_String_Builder *content, Samples *samples)
 {
-    nob_log(NOB_ERROR, "Usage: %s <train.csv> [test.csv]", program);
+    Inflate_Stream is = {
+        .path = path,
+        .f = f,
+    };
+    pthread_mutex_init(&is.lock, NULL);
+    pthread_cond_init(&is.cond, NULL);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, inflate_thread, &is) != 0) {
+        nob_log(NOB_ERROR, "Could not create thread");
+        return false;
+    }
+
+    // The content is reallocated as it grows, so the samples are kept as offsets until the end
+    Sample_Spans spans = {0};
+    size_t lines_count = 0;
+    size_t parsed = content->count;
+    Inflate_Chunk chunk;
+    while (true) {
+        bool more = inflate_stream_pop(&is, &chunk);
+        if (more) {
+            nob_sb_append_buf(content, chunk.data, chunk.count);
+            free(chunk.data);
+        }
+
+        while (parsed < content->count) {
+            size_t line_end = parsed + record_end(content->items + parsed, content->count - parsed);
+            bool complete = line_end < content->count;
+            if (!complete && more) break;
+            Nob_String_View line = nob_sv_from_parts(content->items + parsed, line_end - parsed);
+            if (lines_count++ > 0) { // ignore the header
+                Sample sample = parse_sample(line);
+                nob_da_append(&spans, ((Sample_Span) {
+                    .klass = sample.klass,
+                    .offset = sample.text.data - content->items,
+                    .count = sample.text.count,
+                }));
+            }
+            parsed = complete ? line_end + 1 : line_end;
+        }
+
+        if (!more) break;
+    }
+
+    pthread_join(thread, NULL);
+    pthread_mutex_destroy(&is.lock);
+    pthread_cond_destroy(&is.cond);
+
+    *samples = (Samples) {0};
+    for (size_t i = 0; i < spans.count; ++i) {
+        nob_da_append(samples, ((Sample) {
+            .klass = spans.items[i].klass,
+            .text = nob_sv_from_parts(content->items + spans.items[i].offset, spans.items[i].count),
+        }));
+    }
+    nob_da_free(spans);
+    return !is.failed;
 }
 
-void interactive_mode(Klass_Predictor *kp)
+// Reads and parses the CSV file, which may be gzip compressed. The samples point into the content.
+// The plain CSV is parsed with nprocs threads, or with all the available CPUs if it's 0.
+bool load_samples(const char *path, size_t nprocs, Nob_String_Builder *content, Samples *samples)
 {
-    nob_log(NOB_INFO, "Provide News Title:");
-    while (true) {
-        fgets(buffer, sizeof(buffer), stdin);
-        double begin = clock_get_secs();
-        size_t predicted_klass = klass_predictor_predict(kp, nob_sv_from_cstr(buffer), K);
-        double end = clock_get_secs();
-        nob_log(NOB_INFO, "Topic: %s (%.3lfsecs)", klass_names[predicted_klass], end - begin);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        nob_log(NOB_ERROR, "Could not read file %s: %s", path, strerror(errno));
+        return false;
+    }
+    unsigned char magic[2] = {0};
+    bool gzip = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && magic[0] == 0x1f && magic[1] == 0x8b;
+    if (!gzip) {
+        fclose(f);
+        if (!nob_read_entire_file(path, content)) return false;
+        Cpus cpus = {0};
+        if (nprocs == 0) nprocs = available_cpus(&cpus);
+        *samples = parse_samples_parallel(nob_sv_from_parts(content->items, content->count), nprocs);
+        nob_da_free(cpus);
+        return true;
     }
+
+    rewind(f);
+    bool result = load_gzip_samples(path, f, content, samples);
+    fclose(f);
+    return result;
 }
 
-int main(int argc, char **argv)
+const char *klass_names[] = {"World", "Sports", "Business", "Sci/Tech"};
+
+// Calls the callback for every record of the CSV file (which may be gzip compressed) except
+// the header without keeping more than a chunk of the file in memory at a time
+bool stream_records(const char *path, void (*callback)(Nob_String_View record, void *user), void *user)
 {
-    const char *program = nob_shift_args(&argc, &argv);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        nob_log(NOB_ERROR, "Could not read file %s: %s", path, strerror(errno));
+        return false;
+    }
+    unsigned char magic[2] = {0};
+    bool gzip = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && magic[0] == 0x1f && magic[1] == 0x8b;
+    rewind(f);
 
-    if (argc <= 0) {
-        usage(program);
-        nob_log(NOB_ERROR, "ERROR: no train file is provided");
-        return 1;
+    Inflate_Stream is = {
+        .path = path,
+        .f = f,
+    };
+    pthread_t thread;
+    if (gzip) {
+        pthread_mutex_init(&is.lock, NULL);
+        pthread_cond_init(&is.cond, NULL);
+        if (pthread_create(&thread, NULL, inflate_thread, &is) != 0) {
+            nob_log(NOB_ERROR, "Could not create thread");
+            fclose(f);
+            return false;
+        }
     }
-    const char *train_path = nob_shift_args(&argc, &argv);
-    Nob_String_Builder train_content = {0};
-    if (!nob_read_entire_file(train_path, &train_content)) return 1;
-    Samples train_samples = parse_samples(nob_sv_from_parts(train_content.items, train_content.count));
 
-    Klass_Predictor kp = {0};
-    klass_predictor_init(&kp, train_samples);
+    bool result = true;
+    Nob_String_Builder pending = {0};
+    size_t records_count = 0;
+    while (true) {
+        Inflate_Chunk chunk = {0};
+        bool more;
+        if (gzip) {
+            more = inflate_stream_pop(&is, &chunk);
+        } else {
+            chunk.data = malloc(GZIP_CHUNK_SIZE);
+            assert(chunk.data != NULL);
+            chunk.count = fread(chunk.data, 1, GZIP_CHUNK_SIZE, f);
+            if (ferror(f)) {
+                nob_log(NOB_ERROR, "Could not read file %s: %s", path, strerror(errno));
+                result = false;
+            }
+            more = chunk.count > 0;
+        }
+        if (more) nob_sb_append_buf(&pending, chunk.data, chunk.count);
+        free(chunk.data);
+
+        size_t parsed = 0;
+        while (parsed < pending.count) {
+            size_t end = parsed + record_end(pending.items + parsed, pending.count - parsed);
+            bool complete = end < pending.count;
+            if (!complete && more) break;
+            if (records_count++ > 0) callback(nob_sv_from_parts(pending.items + parsed, end - parsed), user);
+            parsed = complete ? end + 1 : end;
+        }
+        memmove(pending.items, pending.items + parsed, pending.count - parsed);
+        pending.count -= parsed;
+
+        if (!more) break;
+    }
+    nob_sb_free(pending);
+
+    if (gzip) {
+        pthread_join(thread, NULL);
+        pthread_mutex_destroy(&is.lock);
+        pthread_cond_destroy(&is.cond);
+        if (is.failed) result = false;
+    }
+    fclose(f);
+    return result;
+}
+
+// Class-stratified sampling of the train set within a memory budget. Each class gets an equal
+// share of the budget (the total never exceeds it) and keeps the records with the smallest
+// random keys that fit into it, which is a uniform random sample of the class (bottom-k
+// sampling, a reservoir sample that also works for the records of different sizes).
+typedef struct {
+    // 0 means unlimited
+    size_t max_bytes;
+    size_t max_samples;
+} Sample_Budget;
+
+typedef struct {
+    double key;
+    size_t index;
+    size_t klass;
+    char *text;
+    size_t count;
+} Reservoir_Item;
+
+typedef struct {
+    Reservoir_Item *items;
+    size_t count;
+    size_t capacity;
+    size_t bytes;
+    size_t seen;
+    // The share of the budget, may be 0 if the budget is smaller than the amount of classes
+    size_t max_bytes;
+    size_t max_samples;
+} Reservoir;
+
+typedef struct {
+    Reservoir reservoirs[NOB_ARRAY_LEN(klass_names)];
+    Sample_Budget budget;
+    size_t records_count;
+} Reservoir_Sampler;
+
+static size_t reservoir_item_bytes(const Reservoir_Item *item)
+{
+    return item->count + sizeof(Sample);
+}
+
+// Max-heap by key
+static void reservoir_push(Reservoir *r, Reservoir_Item item)
+{
+    nob_da_append(r, item);
+    r->bytes += reservoir_item_bytes(&item);
+    for (size_t i = r->count - 1; i > 0 && r->items[(i - 1)/2].key < r->items[i].key; i = (i - 1)/2) {
+        Reservoir_Item t = r->items[i];
+        r->items[i] = r->items[(i - 1)/2];
+        r->items[(i - 1)/2] = t;
+    }
+}
+
+static void reservoir_pop(Reservoir *r)
+{
+    r->bytes -= reservoir_item_bytes(&r->items[0]);
+    free(r->items[0].text);
+    r->items[0] = r->items[--r->count];
+    size_t i = 0;
+    while (true) {
+        size_t max = i;
+        size_t left = 2*i + 1, right = 2*i + 2;
+        if (left < r->count && r->items[left].key > r->items[max].key) max = left;
+        if (right < r->count && r->items[right].key > r->items[max].key) max = right;
+        if (max == i) break;
+        Reservoir_Item t = r->items[i];
+        r->items[i] = r->items[max];
+        r->items[max] = t;
+        i = max;
+    }
+}
+
+static bool reservoir_over_budget(const Reservoir_Sampler *rs, const Reservoir *r, size_t bytes, size_t count)
+{
+    return (rs->budget.max_bytes > 0 && bytes > r->max_bytes) || (rs->budget.max_samples > 0 && count > r->max_samples);
+}
+
+static void reservoir_sample_record(Nob_String_View record, void *user)
+{
+    Reservoir_Sampler *rs = user;
+    size_t index = rs->records_count++;
+    Sample sample = parse_sample(record);
+    if (sample.klass >= NOB_ARRAY_LEN(rs->reservoirs)) return;
+    Reservoir *r = &rs->reservoirs[sample.klass];
+    r->seen += 1;
+
+    double key = (double)rand()/RAND_MAX;
+    // Would be evicted right away
+    bool over = reservoir_over_budget(rs, r, r->bytes + sample.text.count + sizeof(Sample), r->count + 1);
+    if (over && (r->count == 0 || key >= r->items[0].key)) return;
+
+    Reservoir_Item item = {
+        .key = key,
+        .index = index,
+        .klass = sample.klass,
+        .text = malloc(sample.text.count),
+        .count = sample.text.count,
+    };
+    assert(item.count == 0 || item.text != NULL);
+    memcpy(item.text, sample.text.data, sample.text.count);
+    reservoir_push(r, item);
+    while (reservoir_over_budget(rs, r, r->bytes, r->count)) reservoir_pop(r);
+}
+
+static int compare_reservoir_items_by_index(const void *a, const void *b)
+{
+    const Reservoir_Item *ia = a;
+    const Reservoir_Item *ib = b;
+    if (ia->index < ib->index) return -1;
+    if (ia->index > ib->index) return 1;
+    return 0;
+}
+
+// Streams the CSV file keeping only a class-stratified random sample within the budget.
+// The kept samples go into the content in their original order.
+bool load_samples_sampled(const char *path, Sample_Budget budget, Nob_String_Builder *content, Samples *samples)
+{
+    size_t klasses_count = NOB_ARRAY_LEN(klass_names);
+    Reservoir_Sampler rs = { .budget = budget };
+    // The remainder goes to the first classes so the shares add up to exactly the budget
+    for (size_t klass = 0; klass < klasses_count; ++klass) {
+        Reservoir *r = &rs.reservoirs[klass];
+        r->max_bytes = budget.max_bytes/klasses_count + (klass < budget.max_bytes%klasses_count);
+        r->max_samples = budget.max_samples/klasses_count + (klass < budget.max_samples%klasses_count);
+    }
+    bool result = stream_records(path, reservoir_sample_record, &rs);
+
+    struct { Reservoir_Item *items; size_t count; size_t capacity; } kept = {0};
+    for (size_t klass = 0; klass < klasses_count; ++klass) {
+        Reservoir *r = &rs.reservoirs[klass];
+        nob_da_append_many(&kept, r->items, r->count);
+        nob_log(NOB_INFO, "Class %s: kept %zu/%zu samples (%zu bytes)", klass_names[klass], r->count, r->seen, r->bytes);
+        nob_da_free(*r);
+    }
+    qsort(kept.items, kept.count, sizeof(*kept.items), compare_reservoir_items_by_index);
+
+    size_t content_begin = content->count;
+    for (size_t i = 0; i < kept.count; ++i) {
+        nob_sb_append_buf(content, kept.items[i].text, kept.items[i].count);
+        free(kept.items[i].text);
+    }
+    *samples = (Samples) {0};
+    size_t offset = content_begin;
+    for (size_t i = 0; i < kept.count; ++i) {
+        nob_da_append(samples, ((Sample) {
+            .klass = kept.items[i].klass,
+            .text = nob_sv_from_parts(content->items + offset, kept.items[i].count),
+        }));
+        offset += kept.items[i].count;
+    }
+    nob_da_free(kept);
+
+    nob_log(NOB_INFO, "Sampled %zu/%zu records of %s using %zu bytes", samples->count, rs.records_count, path, content->count - content_begin + samples->count*sizeof(Sample));
+    return result;
+}
+
+typedef struct {
+    float distance;
+    size_t klass;
+    const Sample *sample;
+} NCD;
+
+typedef struct {
+    NCD *items;
+    size_t count;
+    size_t capacity;
+} NCDs;
+
+// NCD for the case when the compressed sizes of both of the texts are already known
+float ncd_with_sizes(Arena *arena, const Compressor *c, Nob_String_View a, float ca, Nob_String_View b, float cb)
+{
+    Nob_String_View ab = nob_sv_from_cstr(arena_sprintf(arena, SV_Fmt" "SV_Fmt, SV_Arg(a), SV_Arg(b)));
+    float cab = c->compressed_size(arena, ab, c->level);
+    float mn = ca; if (mn > cb) mn = cb;
+    float mx = ca; if (mx < cb) mx = cb;
+    return (cab - mn)/mx;
+}
+
+float ncd(Arena *arena, const Compressor *c, Nob_String_View a, Nob_String_View b, float cb)
+{
+    float ca = c->compressed_size(arena, a, c->level);
+    return ncd_with_sizes(arena, c, a, ca, b, cb);
+}
+
+int compare_ncds(const void *a, const void *b)
+{
+    const NCD *na = a;
+    const NCD *nb = b;
+    if (na->distance < nb->distance) return -1;
+    if (na->distance > nb->distance) return 1;
+    return 0;
+}
+
+Nob_String_View sv_prefix(Nob_String_View sv, size_t prefix)
+{
+    if (prefix > 0 && sv.count > prefix) sv.count = prefix;
+    return sv;
+}
+
+#define TRAIN_SEGMENT_CAPACITY 4096
+#define TRAIN_SEGMENTS_MAX (64*1024)
+
+// Append-only storage of the train samples. It grows by arena-backed segments that never move,
+// so the readers can keep using all the samples below the count they observed while new ones
+// are being appended.
+typedef struct {
+    Sample **segments;
+    _Atomic size_t count;
+    Arena arena;
+} Train_Set;
+
+Sample *train_set_get(Train_Set *ts, size_t index)
+{
+    return &ts->segments[index/TRAIN_SEGMENT_CAPACITY][index%TRAIN_SEGMENT_CAPACITY];
+}
+
+size_t train_set_snapshot(Train_Set *ts)
+{
+    return atomic_load_explicit(&ts->count, memory_order_acquire);
+}
+
+// Only a single writer is allowed at a time
+void train_set_push(Train_Set *ts, Sample sample)
+{
+    size_t count = atomic_load_explicit(&ts->count, memory_order_relaxed);
+    if (ts->segments == NULL) {
+        ts->segments = calloc(TRAIN_SEGMENTS_MAX, sizeof(*ts->segments));
+        assert(ts->segments != NULL);
+    }
+    size_t segment = count/TRAIN_SEGMENT_CAPACITY;
+    assert(segment < TRAIN_SEGMENTS_MAX && "Too many train samples");
+    if (ts->segments[segment] == NULL) {
+        ts->segments[segment] = arena_alloc(&ts->arena, TRAIN_SEGMENT_CAPACITY*sizeof(Sample));
+    }
+    ts->segments[segment][count%TRAIN_SEGMENT_CAPACITY] = sample;
+    atomic_store_explicit(&ts->count, count + 1, memory_order_release);
+}
+
+// Keeps the segments around for reuse
+void train_set_clear(Train_Set *ts)
+{
+    atomic_store_explicit(&ts->count, 0, memory_order_release);
+}
+
+#define CACHE_LINE_SIZE 64
+
+// Padded to the cache line so the workers updating their states do not share lines
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) Train_Set *train;
+    size_t train_begin;
+    size_t train_end;
+    Nob_String_View text;
+    // When non-zero only the first `prefix` bytes of the texts are compared
+    size_t prefix;
+    const Compressor *compressor;
+
+    NCDs ncds;
+    Arena arena;
+    // Usage of the arena by the recent queries, see klassify_state_reset()
+    size_t arena_peak;
+} Klassify_State;
+
+// The arena pages above twice the recent peak usage are given back to the OS, so an outlier
+// query does not pin its memory while the steady state is not decommitted and re-faulted on
+// every query. The peak decays by 1/KLASSIFY_ARENA_PEAK_DECAY per query.
+#define KLASSIFY_ARENA_PEAK_DECAY 8
+
+static void klassify_state_reset(Klassify_State *state)
+{
+    size_t used = arena_used_bytes(&state->arena);
+    size_t threshold = 2*state->arena_peak;
+    if (threshold < SCRATCH_ARENA_RETAIN) threshold = SCRATCH_ARENA_RETAIN;
+    // Only the pages committed above the threshold are touched, usually none
+    arena_reset_decommit(&state->arena, threshold);
+    size_t decayed = state->arena_peak - state->arena_peak/KLASSIFY_ARENA_PEAK_DECAY;
+    state->arena_peak = used > decayed ? used : decayed;
+}
+
+void *klassify_thread(void *params)
+{
+    Klassify_State *state = params;
+
+    Nob_String_View text = sv_prefix(state->text, state->prefix);
+    float cb = state->compressor->compressed_size(&state->arena, text, state->compressor->level);
+    // Lives in the arena until the next klass_predictor_rank() resets it
+    arena_da_reserve(&state->arena, &state->ncds, state->train_end - state->train_begin);
+    Arena_Mark mark = arena_snapshot(&state->arena);
+    for (size_t i = state->train_begin; i < state->train_end; ++i) {
+        Sample *sample = train_set_get(state->train, i);
+        float distance;
+        if (state->prefix > 0) {
+            distance = ncd_with_sizes(&state->arena, state->compressor, sv_prefix(sample->text, state->prefix), sample->prefix_size, text, cb);
+        } else {
+            distance = ncd_with_sizes(&state->arena, state->compressor, sample->text, sample->size, text, cb);
+        }
+        arena_rewind(&state->arena, mark);
+        arena_da_append(&state->arena, &state->ncds, ((NCD) {
+            .distance = distance,
+            .klass = sample->klass,
+            .sample = sample,
+        }));
+    }
+
+    return NULL;
+}
+
+typedef struct {
+    Samples samples;
+    float *sizes;
+    const Compressor *compressor;
+    size_t prefix;
+    size_t begin, end;
+    Arena arena;
+} Compressed_Sizes_Job;
+
+void *compressed_sizes_thread(void *params)
+{
+    Compressed_Sizes_Job *job = params;
+    for (size_t i = job->begin; i < job->end; ++i) {
+        job->sizes[i] = job->compressor->compressed_size(&job->arena, sv_prefix(job->samples.items[i].text, job->prefix), job->compressor->level);
+        arena_reset(&job->arena);
+    }
+    arena_free(&job->arena);
+    return NULL;
+}
+
+// Compressed sizes of the samples, or of their first `prefix` bytes when `prefix` is non-zero
+float *compute_compressed_sizes(Samples samples, const Compressor *c, size_t prefix, size_t nprocs)
+{
+    float *sizes = malloc(samples.count*sizeof(*sizes));
+    assert(sizes != NULL);
+    pthread_t *threads = malloc(nprocs*sizeof(*threads));
+    Compressed_Sizes_Job *jobs = calloc(nprocs, sizeof(*jobs));
+    assert(threads != NULL && jobs != NULL);
+    for (size_t i = 0; i < nprocs; ++i) {
+        jobs[i].samples = samples;
+        jobs[i].sizes = sizes;
+        jobs[i].compressor = c;
+        jobs[i].prefix = prefix;
+        jobs[i].begin = samples.count*i/nprocs;
+        jobs[i].end = samples.count*(i + 1)/nprocs;
+        if (pthread_create(&threads[i], NULL, compressed_sizes_thread, &jobs[i]) != 0) {
+            nob_log(NOB_ERROR, "Could not create thread");
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < nprocs; ++i) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            nob_log(NOB_ERROR, "Could not join thread");
+            exit(1);
+        }
+    }
+    free(threads);
+    free(jobs);
+    return sizes;
+}
+
+typedef struct {
+    size_t nprocs;
+    // Pin i-th worker to the CPU cpus.items[i%cpus.count]
+    bool pin;
+    Cpus cpus;
+
+    // Can grow while the predictor is in use, see klass_predictor_add()
+    Train_Set train;
+    pthread_mutex_t train_lock;
+    Arena insert_arena;
+    Compressor compressor;
+
+    // Progressive refinement: rank all of the train samples by the NCD of their first
+    // `prefix` bytes and recompute the exact NCD only for the best `refine` of them.
+    // `prefix == 0` disables the first tier.
+    size_t prefix;
+    size_t refine;
+    Train_Set candidates;
+
+    // Keep only a class-stratified random sample of the train file, see load_samples_sampled()
+    Sample_Budget budget;
+    // Pages backing the train content, the train set and the worker arenas
+    Arena_Pages pages;
+    Arena content_arena;
+
+    pthread_t *threads;
+    Klassify_State *states;
+    Arena states_arena;
+
+    NCDs ncds;
+
+    // Statistics of the last klass_predictor_predict() call
+    size_t prefix_klass;
+    double prefix_secs;
+    double refine_secs;
+
+    // Owned by the predictors created with klass_predictor_load()
+    Nob_String_Builder train_content;
+    Samples train_samples;
+
+    // Managed by Hot_Predictor
+    size_t refs;
+    bool retired;
+    size_t generation;
+} Klass_Predictor;
+
+// The compressor must be set before the initialization since the compressed sizes of the
+// train samples are precomputed with it.
+// The amount of workers is derived from the CPU affinity and the cgroup quota unless kp->nprocs is set beforehand
+void klass_predictor_init(Klass_Predictor *kp, Samples train_samples)
+{
+    size_t cpus = available_cpus(&kp->cpus);
+    if (kp->nprocs == 0) kp->nprocs = cpus;
+    if (kp->pin && kp->cpus.count == 0) {
+        nob_log(NOB_WARNING, "No CPUs to pin the workers to");
+        kp->pin = false;
+    }
+    if (kp->pin && kp->nprocs > kp->cpus.count) {
+        nob_log(NOB_WARNING, "%zu workers are pinned to only %zu CPUs", kp->nprocs, kp->cpus.count);
+    }
+
+    pthread_mutex_init(&kp->train_lock, NULL);
+    kp->train.arena.pages = kp->pages;
+    float *sizes = compute_compressed_sizes(train_samples, &kp->compressor, 0, kp->nprocs);
+    float *prefix_sizes = kp->prefix > 0 ? compute_compressed_sizes(train_samples, &kp->compressor, kp->prefix, kp->nprocs) : NULL;
+    for (size_t i = 0; i < train_samples.count; ++i) {
+        Sample sample = train_samples.items[i];
+        sample.size = sizes[i];
+        if (prefix_sizes != NULL) sample.prefix_size = prefix_sizes[i];
+        train_set_push(&kp->train, sample);
+    }
+    free(sizes);
+    free(prefix_sizes);
+
+    kp->threads = malloc(kp->nprocs*sizeof(pthread_t));
+    assert(kp->threads != NULL);
+    memset(kp->threads, 0, kp->nprocs*sizeof(pthread_t));
+    kp->states = arena_alloc_aligned(&kp->states_arena, kp->nprocs*sizeof(Klassify_State), CACHE_LINE_SIZE);
+    memset(kp->states, 0, kp->nprocs*sizeof(Klassify_State));
+    for (size_t i = 0; i < kp->nprocs; ++i) kp->states[i].arena.pages = kp->pages;
+}
+
+// Computes the NCDs between the text and the first train_count samples of the train set and puts them sorted into kp->ncds
+void klass_predictor_rank(Klass_Predictor *kp, Train_Set *train, size_t train_count, Nob_String_View text, size_t prefix)
+{
+    for (size_t i = 0; i < kp->nprocs; ++i) {
+        kp->states[i].train = train;
+        kp->states[i].train_begin = train_count*i/kp->nprocs;
+        kp->states[i].train_end = train_count*(i + 1)/kp->nprocs;
+        kp->states[i].text = text;
+        kp->states[i].prefix = prefix;
+        kp->states[i].compressor = &kp->compressor;
+        kp->states[i].ncds = (NCDs) {0};
+        klassify_state_reset(&kp->states[i]);
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (kp->pin) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(kp->cpus.items[i%kp->cpus.count], &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        if (pthread_create(&kp->threads[i], &attr, klassify_thread, &kp->states[i]) != 0) {
+            nob_log(NOB_ERROR, "Could not create thread");
+            exit(1);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    kp->ncds.count = 0;
+    for (size_t i = 0; i < kp->nprocs; ++i) {
+        if (pthread_join(kp->threads[i], NULL) != 0) {
+            nob_log(NOB_ERROR, "Could not join thread");
+            exit(1);
+        }
+        nob_da_append_many(&kp->ncds, kp->states[i].ncds.items, kp->states[i].ncds.count);
+    }
+    qsort(kp->ncds.items, kp->ncds.count, sizeof(*kp->ncds.items), compare_ncds);
+}
+
+size_t klass_vote(NCDs ncds, size_t k)
+{
+    size_t klass_freq[NOB_ARRAY_LEN(klass_names)] = {0};
+    for (size_t i = 0; i < k && i < ncds.count; ++i) {
+        klass_freq[ncds.items[i].klass] += 1;
+    }
+
+    size_t predicted_klass = 0;
+    for (size_t i = 1; i < NOB_ARRAY_LEN(klass_names); ++i) {
+        if (klass_freq[predicted_klass] < klass_freq[i]) {
+            predicted_klass = i;
+        }
+    }
+
+    return predicted_klass;
+}
+
+size_t klass_predictor_predict(Klass_Predictor *kp, Nob_String_View text, size_t k)
+{
+    kp->prefix_secs = 0;
+    kp->refine_secs = 0;
+    size_t train_count = train_set_snapshot(&kp->train);
+
+    if (kp->prefix == 0) {
+        double begin = clock_get_secs();
+        klass_predictor_rank(kp, &kp->train, train_count, text, 0);
+        kp->refine_secs = clock_get_secs() - begin;
+        kp->prefix_klass = klass_vote(kp->ncds, k);
+        return kp->prefix_klass;
+    }
+
+    double begin = clock_get_secs();
+    klass_predictor_rank(kp, &kp->train, train_count, text, kp->prefix);
+    kp->prefix_klass = klass_vote(kp->ncds, k);
+
+    train_set_clear(&kp->candidates);
+    for (size_t i = 0; i < kp->refine && i < kp->ncds.count; ++i) {
+        train_set_push(&kp->candidates, *kp->ncds.items[i].sample);
+    }
+    double middle = clock_get_secs();
+    kp->prefix_secs = middle - begin;
+
+    klass_predictor_rank(kp, &kp->candidates, train_set_snapshot(&kp->candidates), text, 0);
+    kp->refine_secs = clock_get_secs() - middle;
+
+    return klass_vote(kp->ncds, k);
+}
+
+// Appends a new train sample to a live predictor. Safe to call concurrently with
+// klass_predictor_predict(), which never waits for it: the predictions already in flight keep
+// working with the samples they started with and the following ones see the new sample.
+void klass_predictor_add(Klass_Predictor *kp, size_t klass, Nob_String_View text)
+{
+    pthread_mutex_lock(&kp->train_lock);
+    char *data = arena_alloc(&kp->train.arena, text.count);
+    memcpy(data, text.data, text.count);
+    Sample sample = {
+        .klass = klass,
+        .text = nob_sv_from_parts(data, text.count),
+    };
+    sample.size = kp->compressor.compressed_size(&kp->insert_arena, sample.text, kp->compressor.level);
+    if (kp->prefix > 0) {
+        sample.prefix_size = kp->compressor.compressed_size(&kp->insert_arena, sv_prefix(sample.text, kp->prefix), kp->compressor.level);
+    }
+    arena_reset(&kp->insert_arena);
+    arena_trim(&kp->insert_arena, SCRATCH_ARENA_RETAIN);
+    train_set_push(&kp->train, sample);
+    pthread_mutex_unlock(&kp->train_lock);
+}
+
+// Allocates a predictor with the same settings as `config` without initializing it
+Klass_Predictor *klass_predictor_new(const Klass_Predictor *config)
+{
+    Klass_Predictor *kp = calloc(1, sizeof(*kp));
+    assert(kp != NULL);
+    kp->nprocs = config->nprocs;
+    kp->pin = config->pin;
+    kp->prefix = config->prefix;
+    kp->refine = config->refine;
+    kp->compressor = config->compressor;
+    kp->budget = config->budget;
+    kp->pages = config->pages;
+    return kp;
+}
+
+// Loads the train samples within the budget of the config, if any
+bool load_train_samples(const Klass_Predictor *config, const char *train_path, Nob_String_Builder *content, Samples *samples)
+{
+    if (config->budget.max_bytes == 0 && config->budget.max_samples == 0) {
+        return load_samples(train_path, config->nprocs, content, samples);
+    }
+    return load_samples_sampled(train_path, config->budget, content, samples);
+}
+
+// Copies the content the samples point into to the arena and makes the samples point into the copy,
+// e.g. to back it with huge pages
+void samples_move_content(Arena *arena, Nob_String_View content, Samples samples)
+{
+    char *data = arena_alloc(arena, content.count);
+    memcpy(data, content.data, content.count);
+    for (size_t i = 0; i < samples.count; ++i) {
+        samples.items[i].text.data = data + (samples.items[i].text.data - content.data);
+    }
+}
+
+// Creates a new predictor configured the same way as `config` from the train file
+Klass_Predictor *klass_predictor_load(const Klass_Predictor *config, const char *train_path)
+{
+    Klass_Predictor *kp = klass_predictor_new(config);
+    if (!load_train_samples(config, train_path, &kp->train_content, &kp->train_samples)) {
+        nob_sb_free(kp->train_content);
+        nob_da_free(kp->train_samples);
+        free(kp);
+        return NULL;
+    }
+    if (kp->pages != ARENA_PAGES_DEFAULT) {
+        kp->content_arena.pages = kp->pages;
+        samples_move_content(&kp->content_arena, nob_sv_from_parts(kp->train_content.items, kp->train_content.count), kp->train_samples);
+        nob_sb_free(kp->train_content);
+        kp->train_content = (Nob_String_Builder) {0};
+    }
+    klass_predictor_init(kp, kp->train_samples);
+    return kp;
+}
+
+void train_set_free(Train_Set *ts)
+{
+    free(ts->segments);
+    arena_free(&ts->arena);
+    memset(ts, 0, sizeof(*ts));
+}
+
+// Frees a predictor created with klass_predictor_load()
+void klass_predictor_free(Klass_Predictor *kp)
+{
+    for (size_t i = 0; i < kp->nprocs; ++i) {
+        arena_free(&kp->states[i].arena);
+    }
+    arena_free(&kp->states_arena);
+    free(kp->threads);
+    nob_da_free(kp->cpus);
+    train_set_free(&kp->train);
+    train_set_free(&kp->candidates);
+    arena_free(&kp->insert_arena);
+    arena_free(&kp->content_arena);
+    pthread_mutex_destroy(&kp->train_lock);
+    nob_da_free(kp->ncds);
+    nob_da_free(kp->train_samples);
+    nob_sb_free(kp->train_content);
+    free(kp);
+}
+
+#ifdef ARENA_STATS
+void klass_predictor_dump_arena_stats(const Klass_Predictor *kp)
+{
+    for (size_t i = 0; i < kp->nprocs; ++i) {
+        char name[64];
+        snprintf(name, sizeof(name), "worker %zu", i);
+        arena_stats_dump(&kp->states[i].arena, name, stderr);
+    }
+    arena_stats_dump(&kp->train.arena, "train", stderr);
+    arena_stats_dump(&kp->insert_arena, "insert", stderr);
+}
+#endif // ARENA_STATS
+
+// Reference to the current predictor that can be atomically replaced by a new one, e.g. when
+// the train file changes. Predictions acquire the current predictor for their duration, so the
+// ones in flight during the swap finish on the old predictor, which is freed once the last of
+// them releases it.
+typedef struct {
+    Klass_Predictor *current;
+    _Atomic size_t generation;
+    pthread_mutex_t lock;
+
+    const char *train_path;
+    int inotify_fd;
+    pthread_t watcher;
+} Hot_Predictor;
+
+void hot_predictor_init(Hot_Predictor *hp, Klass_Predictor *kp)
+{
+    memset(hp, 0, sizeof(*hp));
+    pthread_mutex_init(&hp->lock, NULL);
+    hp->current = kp;
+    hp->inotify_fd = -1;
+}
+
+Klass_Predictor *hot_predictor_acquire(Hot_Predictor *hp)
+{
+    pthread_mutex_lock(&hp->lock);
+    Klass_Predictor *kp = hp->current;
+    kp->refs += 1;
+    pthread_mutex_unlock(&hp->lock);
+    return kp;
+}
+
+void hot_predictor_release(Hot_Predictor *hp, Klass_Predictor *kp)
+{
+    pthread_mutex_lock(&hp->lock);
+    assert(kp->refs > 0);
+    kp->refs -= 1;
+    bool dead = kp->retired && kp->refs == 0;
+    pthread_mutex_unlock(&hp->lock);
+    if (dead) klass_predictor_free(kp);
+}
+
+void hot_predictor_swap(Hot_Predictor *hp, Klass_Predictor *kp)
+{
+    pthread_mutex_lock(&hp->lock);
+    Klass_Predictor *old = hp->current;
+    kp->generation = old->generation + 1;
+    hp->current = kp;
+    atomic_store(&hp->generation, kp->generation);
+    old->retired = true;
+    bool dead = old->refs == 0;
+    pthread_mutex_unlock(&hp->lock);
+    if (dead) klass_predictor_free(old);
+}
+
+void *hot_predictor_watch_thread(void *params)
+{
+    Hot_Predictor *hp = params;
+    const char *name = strrchr(hp->train_path, '/');
+    name = name ? name + 1 : hp->train_path;
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        ssize_t n = read(hp->inotify_fd, events, sizeof(events));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            nob_log(NOB_ERROR, "Could not read inotify events: %s", strerror(errno));
+            return NULL;
+        }
+
+        bool changed = false;
+        for (char *ptr = events; ptr < events + n; ) {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            if (event->len > 0 && strcmp(event->name, name) == 0) changed = true;
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+        if (!changed) continue;
+
+        nob_log(NOB_INFO, "%s has changed, rebuilding the predictor", hp->train_path);
+        double begin = clock_get_secs();
+        Klass_Predictor *kp = hot_predictor_acquire(hp);
+        Klass_Predictor *new_kp = klass_predictor_load(kp, hp->train_path);
+        hot_predictor_release(hp, kp);
+        if (new_kp == NULL) {
+            nob_log(NOB_ERROR, "Could not rebuild the predictor, keeping the old one");
+            continue;
+        }
+        hot_predictor_swap(hp, new_kp);
+        nob_log(NOB_INFO, "Swapped to the new predictor with %zu train samples (%.3lfsecs)", train_set_snapshot(&new_kp->train), clock_get_secs() - begin);
+    }
+}
+
+// Starts watching the train file in the background. The directory is watched rather than the
+// file itself, so files that are replaced by rename are picked up too.
+bool hot_predictor_watch(Hot_Predictor *hp, const char *train_path)
+{
+    hp->train_path = train_path;
+    hp->inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (hp->inotify_fd < 0) {
+        nob_log(NOB_ERROR, "Could not initialize inotify: %s", strerror(errno));
+        return false;
+    }
+
+    const char *slash = strrchr(train_path, '/');
+    const char *dir = slash == NULL ? "." : slash == train_path ? "/" : nob_temp_sprintf("%.*s", (int)(slash - train_path), train_path);
+    if (inotify_add_watch(hp->inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        nob_log(NOB_ERROR, "Could not watch %s: %s", dir, strerror(errno));
+        return false;
+    }
+
+    if (pthread_create(&hp->watcher, NULL, hot_predictor_watch_thread, hp) != 0) {
+        nob_log(NOB_ERROR, "Could not create thread");
+        return false;
+    }
+    nob_log(NOB_INFO, "Watching %s for changes", train_path);
+    return true;
+}
+
+bool read_all(int fd, void *buf, size_t size)
+{
+    char *ptr = buf;
+    while (size > 0) {
+        ssize_t n = read(fd, ptr, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        ptr += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool write_all(int fd, const void *buf, size_t size)
+{
+    const char *ptr = buf;
+    while (size > 0) {
+        ssize_t n = write(fd, ptr, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        ptr += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Sharded kNN: each shard is a separate process owning a contiguous slice of the train set and
+// answering the queries over a Unix socket with its local top-k, which the coordinator merges.
+//
+// Request:  uint32_t k, uint32_t text_size, text
+// Response: double secs, uint32_t count, count*Shard_Neighbor
+typedef struct {
+    float distance;
+    uint32_t klass;
+} Shard_Neighbor;
+
+typedef struct {
+    pid_t pid;
+    int fd;
+    size_t train_count;
+
+    // Of the last query: time the shard spent computing and the time until its response arrived
+    double compute_secs;
+    double response_secs;
+    // Totals over all the queries
+    double total_compute_secs;
+    double total_response_secs;
+} Shard;
+
+typedef struct {
+    Shard *items;
+    size_t count;
+    NCDs ncds;
+    size_t queries;
+} Shards;
+
+void shard_serve(int fd, Klass_Predictor *kp)
+{
+    Nob_String_Builder text = {0};
+    Shard_Neighbor *neighbors = NULL;
+    while (true) {
+        uint32_t header[2];
+        if (!read_all(fd, header, sizeof(header))) break;
+        if (text.capacity < header[1]) {
+            text.items = realloc(text.items, header[1]);
+            assert(text.items != NULL);
+            text.capacity = header[1];
+        }
+        if (!read_all(fd, text.items, header[1])) break;
+        text.count = header[1];
+
+        double begin = clock_get_secs();
+        klass_predictor_predict(kp, nob_sv_from_parts(text.items, text.count), header[0]);
+        uint32_t count = kp->ncds.count < header[0] ? kp->ncds.count : header[0];
+        neighbors = realloc(neighbors, (count + 1)*sizeof(*neighbors));
+        assert(neighbors != NULL);
+        for (uint32_t i = 0; i < count; ++i) {
+            neighbors[i].distance = kp->ncds.items[i].distance;
+            neighbors[i].klass = kp->ncds.items[i].klass;
+        }
+        double secs = clock_get_secs() - begin;
+
+        if (!write_all(fd, &secs, sizeof(secs))) break;
+        if (!write_all(fd, &count, sizeof(count))) break;
+        if (!write_all(fd, neighbors, count*sizeof(*neighbors))) break;
+    }
+    free(neighbors);
+    nob_sb_free(text);
+}
+
+// Forks the shard processes. Must be called before any threads are started in the current process.
+bool shards_start(Shards *shards, const Klass_Predictor *config, Samples train_samples, size_t count)
+{
+    shards->items = calloc(count, sizeof(*shards->items));
+    assert(shards->items != NULL);
+    shards->count = count;
+
+    for (size_t i = 0; i < count; ++i) {
+        Shard *shard = &shards->items[i];
+        size_t begin = train_samples.count*i/count;
+        size_t end = train_samples.count*(i + 1)/count;
+        shard->train_count = end - begin;
+
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+            nob_log(NOB_ERROR, "Could not create socket pair: %s", strerror(errno));
+            return false;
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            nob_log(NOB_ERROR, "Could not fork shard: %s", strerror(errno));
+            return false;
+        }
+        if (pid == 0) {
+            for (size_t j = 0; j < i; ++j) close(shards->items[j].fd);
+            close(fds[0]);
+            Klass_Predictor *kp = klass_predictor_new(config);
+            Samples slice = {
+                .items = train_samples.items + begin,
+                .count = end - begin,
+            };
+            klass_predictor_init(kp, slice);
+            nob_log(NOB_INFO, "Shard %zu: %zu train samples, %zu workers", i, slice.count, kp->nprocs);
+            shard_serve(fds[1], kp);
+            _exit(0);
+        }
+
+        close(fds[1]);
+        shard->pid = pid;
+        shard->fd = fds[0];
+    }
+
+    return true;
+}
+
+size_t shards_predict(Shards *shards, Nob_String_View text, size_t k)
+{
+    double begin = clock_get_secs();
+    uint32_t header[2] = {k, text.count};
+    for (size_t i = 0; i < shards->count; ++i) {
+        if (!write_all(shards->items[i].fd, header, sizeof(header)) ||
+            !write_all(shards->items[i].fd, text.data, text.count)) {
+            nob_log(NOB_ERROR, "Could not send query to shard %zu: %s", i, strerror(errno));
+            exit(1);
+        }
+    }
+
+    // Collect the responses in the order they arrive to see the stragglers
+    struct pollfd *pfds = calloc(shards->count, sizeof(*pfds));
+    assert(pfds != NULL);
+    for (size_t i = 0; i < shards->count; ++i) {
+        pfds[i].fd = shards->items[i].fd;
+        pfds[i].events = POLLIN;
+    }
+
+    shards->ncds.count = 0;
+    for (size_t pending = shards->count; pending > 0; ) {
+        if (poll(pfds, shards->count, -1) < 0) {
+            if (errno == EINTR) continue;
+            nob_log(NOB_ERROR, "Could not poll shards: %s", strerror(errno));
+            exit(1);
+        }
+        for (size_t i = 0; i < shards->count; ++i) {
+            if (pfds[i].fd < 0 || pfds[i].revents == 0) continue;
+            Shard *shard = &shards->items[i];
+            uint32_t count = 0;
+            if (!read_all(shard->fd, &shard->compute_secs, sizeof(shard->compute_secs)) ||
+                !read_all(shard->fd, &count, sizeof(count))) {
+                nob_log(NOB_ERROR, "Shard %zu has died", i);
+                exit(1);
+            }
+            for (uint32_t j = 0; j < count; ++j) {
+                Shard_Neighbor neighbor;
+                if (!read_all(shard->fd, &neighbor, sizeof(neighbor))) {
+                    nob_log(NOB_ERROR, "Shard %zu has died", i);
+                    exit(1);
+                }
+                nob_da_append(&shards->ncds, ((NCD) {
+                    .distance = neighbor.distance,
+                    .klass = neighbor.klass,
+                }));
+            }
+            shard->response_secs = clock_get_secs() - begin;
+            shard->total_compute_secs += shard->compute_secs;
+            shard->total_response_secs += shard->response_secs;
+            pfds[i].fd = -1;
+            pending -= 1;
+        }
+    }
+    free(pfds);
+    shards->queries += 1;
+
+    qsort(shards->ncds.items, shards->ncds.count, sizeof(*shards->ncds.items), compare_ncds);
+    return klass_vote(shards->ncds, k);
+}
+
+void shards_log_timing(Shards *shards)
+{
+    size_t slowest = 0;
+    for (size_t i = 0; i < shards->count; ++i) {
+        Shard *shard = &shards->items[i];
+        if (shard->response_secs > shards->items[slowest].response_secs) slowest = i;
+        nob_log(NOB_INFO, "Shard %zu: %zu samples, compute %.3lfsecs, response %.3lfsecs (average compute %.3lfsecs, response %.3lfsecs)",
+                i, shard->train_count, shard->compute_secs, shard->response_secs,
+                shard->total_compute_secs/shards->queries, shard->total_response_secs/shards->queries);
+    }
+    nob_log(NOB_INFO, "Slowest shard: %zu", slowest);
+}
+
+void shards_stop(Shards *shards)
+{
+    for (size_t i = 0; i < shards->count; ++i) {
+        close(shards->items[i].fd);
+        waitpid(shards->items[i].pid, NULL, 0);
+    }
+    free(shards->items);
+    nob_da_free(shards->ncds);
+    memset(shards, 0, sizeof(*shards));
+}
+
+// The keys up to this size are stored right in the entry
+#define QUERY_CACHE_INLINE_KEY 48
+
+typedef struct Query_Cache_Entry Query_Cache_Entry;
+
+struct Query_Cache_Entry {
+    uint64_t hash;
+    // Points either to key_inline or to a separately malloc-ed buffer
+    char *key;
+    size_t key_size;
+    char key_inline[QUERY_CACHE_INLINE_KEY];
+    size_t klass;
+    // Generation of the predictor that computed the prediction
+    size_t generation;
+    // The prediction is still being computed by some other caller
+    bool pending;
+    // Callers waiting for the pending prediction. The entry stays alive until all of them
+    // have woken up, even if it is removed from the cache in the meantime
+    size_t waiters;
+    // Removed from the cache while it still had waiters, the last of them frees it
+    bool detached;
+
+    Query_Cache_Entry *bucket_next;
+    Query_Cache_Entry *lru_prev, *lru_next;
+};
+
+// LRU cache of the predictions in front of Klass_Predictor keyed by the normalised query text.
+//
+// Safe to call from several threads. The predictor itself is not reentrant, so the misses are
+// serialized on predict_lock, and identical queries arriving while one of them is being computed
+// wait for that computation instead of starting their own.
+typedef struct {
+    Hot_Predictor *hp;
+    size_t k;
+
+    // Upper bound on the memory taken by the entries and their keys
+    size_t max_bytes;
+    size_t bytes;
+
+    // The entries come and go at a high rate, so they are recycled through a pool
+    Pool entries;
+    Query_Cache_Entry **buckets;
+    size_t buckets_count;
+    // lru_head is the most recently used entry, lru_tail is the next one to evict
+    Query_Cache_Entry *lru_head, *lru_tail;
+
+    size_t hits;
+    size_t misses;
+    size_t coalesced;
+    size_t evictions;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_mutex_t predict_lock;
+} Query_Cache;
+
+void query_cache_init(Query_Cache *qc, Hot_Predictor *hp, size_t k, size_t max_bytes)
+{
+    memset(qc, 0, sizeof(*qc));
+    qc->hp = hp;
+    qc->k = k;
+    qc->max_bytes = max_bytes;
+
+    qc->buckets_count = 64;
+    while (qc->buckets_count*256 < max_bytes) qc->buckets_count *= 2;
+    qc->buckets = calloc(qc->buckets_count, sizeof(*qc->buckets));
+    assert(qc->buckets != NULL);
+    pool_init(&qc->entries, sizeof(Query_Cache_Entry), 0);
+
+    pthread_mutex_init(&qc->lock, NULL);
+    pthread_cond_init(&qc->ready, NULL);
+    pthread_mutex_init(&qc->predict_lock, NULL);
+}
+
+// Lowercases the text, collapses the runs of whitespace into a single space and trims it
+Nob_String_View query_normalize(Arena *arena, Nob_String_View text)
+{
+    char *result = arena_alloc(arena, text.count + 1);
+    size_t count = 0;
+    bool space = false;
+    for (size_t i = 0; i < text.count; ++i) {
+        char x = text.data[i];
+        if (isspace((unsigned char)x)) {
+            space = count > 0;
+            continue;
+        }
+        if (space) result[count++] = ' ';
+        space = false;
+        result[count++] = tolower((unsigned char)x);
+    }
+    result[count] = '\0';
+    return nob_sv_from_parts(result, count);
+}
+
+// FNV-1a
+uint64_t query_hash(Nob_String_View sv)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < sv.count; ++i) {
+        hash ^= (unsigned char)sv.data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void query_cache_lru_unlink(Query_Cache *qc, Query_Cache_Entry *e)
+{
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next; else qc->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev; else qc->lru_tail = e->lru_prev;
+    e->lru_prev = NULL;
+    e->lru_next = NULL;
+}
+
+static void query_cache_lru_push(Query_Cache *qc, Query_Cache_Entry *e)
+{
+    e->lru_next = qc->lru_head;
+    if (qc->lru_head) qc->lru_head->lru_prev = e; else qc->lru_tail = e;
+    qc->lru_head = e;
+}
+
+static size_t query_cache_entry_bytes(Query_Cache_Entry *e)
+{
+    return sizeof(*e) + (e->key == e->key_inline ? 0 : e->key_size);
+}
+
+static void query_cache_entry_free(Query_Cache *qc, Query_Cache_Entry *e)
+{
+    if (e->key != e->key_inline) free(e->key);
+    pool_free(&qc->entries, e);
+}
+
+static void query_cache_remove(Query_Cache *qc, Query_Cache_Entry *e)
+{
+    Query_Cache_Entry **bucket = &qc->buckets[e->hash & (qc->buckets_count - 1)];
+    while (*bucket != e) bucket = &(*bucket)->bucket_next;
+    *bucket = e->bucket_next;
+    query_cache_lru_unlink(qc, e);
+    qc->bytes -= query_cache_entry_bytes(e);
+    if (e->waiters > 0) {
+        e->detached = true;
+    } else {
+        query_cache_entry_free(qc, e);
+    }
+}
+
+static void query_cache_evict(Query_Cache *qc)
+{
+    Query_Cache_Entry *e = qc->lru_tail;
+    while (qc->bytes > qc->max_bytes && e != NULL) {
+        Query_Cache_Entry *prev = e->lru_prev;
+        // Somebody is waiting for the pending ones
+        if (!e->pending) {
+            query_cache_remove(qc, e);
+            qc->evictions += 1;
+        }
+        e = prev;
+    }
+}
+
+// Drops all of the computed predictions, e.g. after the train set has changed
+void query_cache_clear(Query_Cache *qc)
+{
+    pthread_mutex_lock(&qc->lock);
+    Query_Cache_Entry *e = qc->lru_tail;
+    while (e != NULL) {
+        Query_Cache_Entry *prev = e->lru_prev;
+        if (!e->pending) query_cache_remove(qc, e);
+        e = prev;
+    }
+    pthread_mutex_unlock(&qc->lock);
+}
+
+size_t query_cache_predict(Query_Cache *qc, Arena *arena, Nob_String_View text)
+{
+    Nob_String_View key = query_normalize(arena, text);
+    uint64_t hash = query_hash(key);
+
+    pthread_mutex_lock(&qc->lock);
+    Query_Cache_Entry *e = qc->buckets[hash & (qc->buckets_count - 1)];
+    while (e != NULL && !(e->hash == hash && e->key_size == key.count && memcmp(e->key, key.data, key.count) == 0)) {
+        e = e->bucket_next;
+    }
+    // Computed by a predictor that has been swapped out since then
+    if (e != NULL && !e->pending && e->generation != atomic_load(&qc->hp->generation)) {
+        query_cache_remove(qc, e);
+        e = NULL;
+    }
+
+    if (e != NULL) {
+        if (e->pending) {
+            qc->coalesced += 1;
+            e->waiters += 1;
+            while (e->pending) pthread_cond_wait(&qc->ready, &qc->lock);
+            e->waiters -= 1;
+        } else {
+            qc->hits += 1;
+        }
+        size_t klass = e->klass;
+        if (e->detached) {
+            if (e->waiters == 0) query_cache_entry_free(qc, e);
+        } else {
+            query_cache_lru_unlink(qc, e);
+            query_cache_lru_push(qc, e);
+        }
+        pthread_mutex_unlock(&qc->lock);
+        return klass;
+    }
+
+    qc->misses += 1;
+    e = pool_alloc(&qc->entries);
+    assert(e != NULL);
+    memset(e, 0, sizeof(*e));
+    e->hash = hash;
+    e->key = key.count <= QUERY_CACHE_INLINE_KEY ? e->key_inline : malloc(key.count);
+    assert(e->key != NULL);
+    memcpy(e->key, key.data, key.count);
+    e->key_size = key.count;
+    e->pending = true;
+    Query_Cache_Entry **bucket = &qc->buckets[hash & (qc->buckets_count - 1)];
+    e->bucket_next = *bucket;
+    *bucket = e;
+    query_cache_lru_push(qc, e);
+    qc->bytes += query_cache_entry_bytes(e);
+    pthread_mutex_unlock(&qc->lock);
+
+    pthread_mutex_lock(&qc->predict_lock);
+    Klass_Predictor *kp = hot_predictor_acquire(qc->hp);
+    size_t klass = klass_predictor_predict(kp, text, qc->k);
+    size_t generation = kp->generation;
+    hot_predictor_release(qc->hp, kp);
+    pthread_mutex_unlock(&qc->predict_lock);
+
+    pthread_mutex_lock(&qc->lock);
+    e->klass = klass;
+    e->generation = generation;
+    e->pending = false;
+    pthread_cond_broadcast(&qc->ready);
+    query_cache_evict(qc);
+    pthread_mutex_unlock(&qc->lock);
+
+    return klass;
+}
+
+void query_cache_log_stats(Query_Cache *qc)
+{
+    pthread_mutex_lock(&qc->lock);
+    size_t lookups = qc->hits + qc->misses + qc->coalesced;
+    nob_log(NOB_INFO, "Cache: %zu hits, %zu misses, %zu coalesced, %zu evictions, hit rate %f, %zu/%zu bytes",
+            qc->hits, qc->misses, qc->coalesced, qc->evictions,
+            lookups > 0 ? (float)(qc->hits + qc->coalesced)/lookups : 0.0f,
+            qc->bytes, qc->max_bytes);
+#ifdef ARENA_STATS
+    pool_stats_dump(&qc->entries, "query cache entries", stderr);
+#endif // ARENA_STATS
+    pthread_mutex_unlock(&qc->lock);
+}
+
+// Pairwise NCD matrix persisted in a memory-mapped file.
+//
+// The file consists of the Ncd_Matrix_Header, one byte per tile telling whether the tile is
+// already computed and then, starting at data_offset, the rows*cols row-major distances
+// stored as either float32 or float16. Since the tiles are marked as done only after all of
+// their distances are written, an interrupted computation can be resumed by just skipping them.
+#define NCD_MATRIX_MAGIC "NCDMTRX"
+#define NCD_MATRIX_VERSION 1
+#define NCD_MATRIX_DEFAULT_TILE 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t elem_size;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t tile;
+    char compressor[16];
+    int32_t level;
+    uint32_t reserved;
+    uint64_t data_offset;
+} Ncd_Matrix_Header;
+
+typedef struct {
+    Ncd_Matrix_Header *header;
+    size_t size;
+    uint8_t *tiles_done;
+    size_t tile_rows;
+    size_t tile_cols;
+    void *data;
+} Ncd_Matrix;
+
+uint16_t f32_to_f16(float value)
+{
+    uint32_t x;
+    memcpy(&x, &value, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    int32_t exp = (int32_t)((x >> 23) & 0xFF) - 127 + 15;
+    uint32_t mant = x & 0x7FFFFF;
+
+    if (((x >> 23) & 0xFF) == 0xFF) return sign | 0x7C00 | (mant ? 0x200 : 0);
+    if (exp >= 31) return sign | 0x7C00;
+    if (exp <= 0) {
+        if (exp < -10) return sign;
+        mant |= 0x800000;
+        uint32_t shift = 14 - exp;
+        uint32_t half = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t mid = 1u << (shift - 1);
+        if (rem > mid || (rem == mid && (half & 1))) half += 1;
+        return sign | half;
+    }
+    uint32_t half = sign | ((uint32_t)exp << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1FFF;
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1))) half += 1;
+    return half;
+}
+
+float f16_to_f32(uint16_t half)
+{
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    uint32_t exp = (half >> 10) & 0x1F;
+    uint32_t mant = half & 0x3FF;
+    uint32_t x;
+    if (exp == 0) {
+        if (mant == 0) {
+            x = sign;
+        } else {
+            exp = 127 - 15 + 1;
+            while ((mant & 0x400) == 0) {
+                mant <<= 1;
+                exp -= 1;
+            }
+            x = sign | (exp << 23) | ((mant & 0x3FF) << 13);
+        }
+    } else if (exp == 31) {
+        x = sign | 0x7F800000 | (mant << 13);
+    } else {
+        x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    }
+    float value;
+    memcpy(&value, &x, sizeof(value));
+    return value;
+}
+
+float ncd_matrix_get(const Ncd_Matrix *m, size_t row, size_t col)
+{
+    size_t index = row*m->header->cols + col;
+    if (m->header->elem_size == sizeof(uint16_t)) return f16_to_f32(((uint16_t*)m->data)[index]);
+    return ((float*)m->data)[index];
+}
+
+void ncd_matrix_set(Ncd_Matrix *m, size_t row, size_t col, float value)
+{
+    size_t index = row*m->header->cols + col;
+    if (m->header->elem_size == sizeof(uint16_t)) ((uint16_t*)m->data)[index] = f32_to_f16(value);
+    else ((float*)m->data)[index] = value;
+}
+
+// Opens the matrix file for resuming or creates it if it does not exist. Existing files must
+// be created with exactly the same parameters.
+bool ncd_matrix_open(Ncd_Matrix *m, const char *path, Ncd_Matrix_Header expected)
+{
+    bool result = true;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        nob_log(NOB_ERROR, "Could not open file %s: %s", path, strerror(errno));
+        nob_return_defer(false);
+    }
+
+    m->tile_rows = (expected.rows + expected.tile - 1)/expected.tile;
+    m->tile_cols = (expected.cols + expected.tile - 1)/expected.tile;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t data_offset = sizeof(Ncd_Matrix_Header) + m->tile_rows*m->tile_cols;
+    data_offset = (data_offset + page_size - 1)/page_size*page_size;
+    m->size = data_offset + expected.rows*expected.cols*expected.elem_size;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        nob_log(NOB_ERROR, "Could not stat file %s: %s", path, strerror(errno));
+        nob_return_defer(false);
+    }
+    bool fresh = st.st_size == 0;
+    if (fresh) {
+        if (ftruncate(fd, m->size) < 0) {
+            nob_log(NOB_ERROR, "Could not resize file %s: %s", path, strerror(errno));
+            nob_return_defer(false);
+        }
+    } else if ((size_t)st.st_size != m->size) {
+        nob_log(NOB_ERROR, "%s was created with different parameters: unexpected size %zu, expected %zu", path, (size_t)st.st_size, m->size);
+        nob_return_defer(false);
+    }
+
+    void *mem = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        nob_log(NOB_ERROR, "Could not map file %s: %s", path, strerror(errno));
+        nob_return_defer(false);
+    }
+    m->header = mem;
+    m->tiles_done = (uint8_t*)mem + sizeof(Ncd_Matrix_Header);
+    m->data = (uint8_t*)mem + data_offset;
+
+    expected.data_offset = data_offset;
+    if (fresh) {
+        *m->header = expected;
+    } else if (memcmp(m->header, &expected, sizeof(expected)) != 0) {
+        nob_log(NOB_ERROR, "%s was created with different parameters", path);
+        munmap(mem, m->size);
+        nob_return_defer(false);
+    }
+
+defer:
+    if (fd >= 0) close(fd);
+    return result;
+}
+
+void ncd_matrix_close(Ncd_Matrix *m)
+{
+    msync(m->header, m->size, MS_SYNC);
+    munmap(m->header, m->size);
+    memset(m, 0, sizeof(*m));
+}
+
+typedef struct {
+    Ncd_Matrix *matrix;
+    Samples rows;
+    Samples cols;
+    float *row_sizes;
+    float *col_sizes;
+    const Compressor *compressor;
+
+    _Atomic size_t *next_tile;
+    _Atomic size_t *done_tiles;
+    size_t skipped_tiles;
+
+    Arena arena;
+} Ncd_Matrix_Worker;
+
+void *ncd_matrix_thread(void *params)
+{
+    Ncd_Matrix_Worker *w = params;
+    Ncd_Matrix *m = w->matrix;
+    size_t tile = m->header->tile;
+    size_t tiles_count = m->tile_rows*m->tile_cols;
+    size_t pending = tiles_count - w->skipped_tiles;
+
+    while (true) {
+        size_t t = atomic_fetch_add(w->next_tile, 1);
+        if (t >= tiles_count) break;
+        if (m->tiles_done[t]) continue;
+
+        size_t row_begin = t/m->tile_cols*tile;
+        size_t col_begin = t%m->tile_cols*tile;
+        size_t row_end = row_begin + tile; if (row_end > w->rows.count) row_end = w->rows.count;
+        size_t col_end = col_begin + tile; if (col_end > w->cols.count) col_end = w->cols.count;
+        for (size_t row = row_begin; row < row_end; ++row) {
+            for (size_t col = col_begin; col < col_end; ++col) {
+                float distance = ncd_with_sizes(&w->arena, w->compressor,
+                                                w->rows.items[row].text, w->row_sizes[row],
+                                                w->cols.items[col].text, w->col_sizes[col]);
+                arena_reset(&w->arena);
+                ncd_matrix_set(m, row, col, distance);
+            }
+        }
+        atomic_thread_fence(memory_order_release);
+        m->tiles_done[t] = 1;
+
+        size_t done = atomic_fetch_add(w->done_tiles, 1) + 1;
+        if (done == pending || done%(pending/100 + 1) == 0) {
+            nob_log(NOB_INFO, "Tiles: %zu/%zu (%f)", done, pending, (float)done/pending);
+        }
+    }
+
+    return NULL;
+}
+
+// Computes the missing tiles of the rows×cols matrix across nprocs threads
+bool ncd_matrix_compute(const char *path, Samples rows, Samples cols, const Compressor *c, size_t tile, size_t elem_size, size_t nprocs)
+{
+    Ncd_Matrix_Header header = {
+        .magic = NCD_MATRIX_MAGIC,
+        .version = NCD_MATRIX_VERSION,
+        .elem_size = elem_size,
+        .rows = rows.count,
+        .cols = cols.count,
+        .tile = tile,
+        .level = c->level,
+    };
+    strncpy(header.compressor, c->name, sizeof(header.compressor) - 1);
+
+    Ncd_Matrix m = {0};
+    if (!ncd_matrix_open(&m, path, header)) return false;
+
+    size_t tiles_count = m.tile_rows*m.tile_cols;
+    size_t skipped_tiles = 0;
+    for (size_t t = 0; t < tiles_count; ++t) skipped_tiles += m.tiles_done[t];
+    nob_log(NOB_INFO, "Matrix %zux%zu, %zu tiles of %zux%zu, %zu already computed", rows.count, cols.count, tiles_count, tile, tile, skipped_tiles);
+    if (skipped_tiles == tiles_count) {
+        ncd_matrix_close(&m);
+        return true;
+    }
+
+    float *row_sizes = compute_compressed_sizes(rows, c, 0, nprocs);
+    float *col_sizes = rows.items == cols.items ? row_sizes : compute_compressed_sizes(cols, c, 0, nprocs);
+
+    _Atomic size_t next_tile = 0;
+    _Atomic size_t done_tiles = 0;
+    pthread_t *threads = malloc(nprocs*sizeof(*threads));
+    Ncd_Matrix_Worker *workers = calloc(nprocs, sizeof(*workers));
+    assert(threads != NULL && workers != NULL);
+    for (size_t i = 0; i < nprocs; ++i) {
+        workers[i].matrix = &m;
+        workers[i].rows = rows;
+        workers[i].cols = cols;
+        workers[i].row_sizes = row_sizes;
+        workers[i].col_sizes = col_sizes;
+        workers[i].compressor = c;
+        workers[i].next_tile = &next_tile;
+        workers[i].done_tiles = &done_tiles;
+        workers[i].skipped_tiles = skipped_tiles;
+        if (pthread_create(&threads[i], NULL, ncd_matrix_thread, &workers[i]) != 0) {
+            nob_log(NOB_ERROR, "Could not create thread");
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < nprocs; ++i) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            nob_log(NOB_ERROR, "Could not join thread");
+            exit(1);
+        }
+        arena_free(&workers[i].arena);
+    }
+
+    if (col_sizes != row_sizes) free(col_sizes);
+    free(row_sizes);
+    free(threads);
+    free(workers);
+    ncd_matrix_close(&m);
+    return true;
+}
+
+// Alternative to the kNN that compares the query with every train sample: one compressor
+// context per class primed with a dictionary of representative class text. The predicted class
+// is the one whose dictionary helps to compress the query the most, so the prediction is
+// O(classes) instead of O(train samples).
+#define KLASS_MODEL_DICT_CAPACITY (32*1024)
+#define KLASS_MODEL_NGRAM 4
+#define KLASS_MODEL_NGRAM_BITS 22
+
+typedef struct {
+    Nob_String_Builder dict;
+    size_t samples_used;
+    z_stream stream;
+} Klass_Model;
+
+typedef struct {
+    Klass_Model models[NOB_ARRAY_LEN(klass_names)];
+    int level;
+    Nob_String_Builder output;
+} Klass_Models;
+
+typedef struct {
+    float gain;
+    size_t index;
+} Dict_Candidate;
+
+typedef struct {
+    Dict_Candidate *items;
+    size_t count;
+    size_t capacity;
+} Dict_Candidates;
+
+static void dict_heap_push(Dict_Candidates *heap, Dict_Candidate c)
+{
+    nob_da_append(heap, c);
+    size_t i = heap->count - 1;
+    while (i > 0 && heap->items[(i - 1)/2].gain < heap->items[i].gain) {
+        Dict_Candidate t = heap->items[i];
+        heap->items[i] = heap->items[(i - 1)/2];
+        heap->items[(i - 1)/2] = t;
+        i = (i - 1)/2;
+    }
+}
+
+static Dict_Candidate dict_heap_pop(Dict_Candidates *heap)
+{
+    Dict_Candidate top = heap->items[0];
+    heap->items[0] = heap->items[--heap->count];
+    size_t i = 0;
+    while (true) {
+        size_t max = i;
+        size_t l = 2*i + 1, r = 2*i + 2;
+        if (l < heap->count && heap->items[l].gain > heap->items[max].gain) max = l;
+        if (r < heap->count && heap->items[r].gain > heap->items[max].gain) max = r;
+        if (max == i) break;
+        Dict_Candidate t = heap->items[i];
+        heap->items[i] = heap->items[max];
+        heap->items[max] = t;
+        i = max;
+    }
+    return top;
+}
+
+static uint32_t ngram_hash(const char *data)
+{
+    uint32_t h;
+    memcpy(&h, data, sizeof(h));
+    return (h*2654435761u) >> (32 - KLASS_MODEL_NGRAM_BITS);
+}
+
+// Amount of the n-grams of the text that are not in `covered` per byte of the text
+static float dict_gain(const uint8_t *covered, Nob_String_View text)
+{
+    if (text.count < KLASS_MODEL_NGRAM) return 0;
+    size_t fresh = 0;
+    for (size_t i = 0; i + KLASS_MODEL_NGRAM <= text.count; ++i) {
+        uint32_t h = ngram_hash(text.data + i);
+        if (!(covered[h/8] & (1 << h%8))) fresh += 1;
+    }
+    return (float)fresh/(text.count + 1);
+}
+
+// Greedily picks the samples of the class that add the most uncovered n-grams per byte until
+// the dictionary is full. The gain of a sample can only go down as the coverage grows, so the
+// stale gains on the heap are upper bounds and only the top needs to be reevaluated (lazy greedy).
+static void klass_model_build_dict(Klass_Model *model, Samples train_samples, size_t klass)
+{
+    uint8_t *covered = calloc(1 << KLASS_MODEL_NGRAM_BITS >> 3, 1);
+    assert(covered != NULL);
+
+    Dict_Candidates heap = {0};
+    for (size_t i = 0; i < train_samples.count; ++i) {
+        if (train_samples.items[i].klass != klass) continue;
+        dict_heap_push(&heap, ((Dict_Candidate) {
+            .gain = dict_gain(covered, train_samples.items[i].text),
+            .index = i,
+        }));
+    }
+
+    struct { size_t *items; size_t count; size_t capacity; } picked = {0};
+    size_t dict_size = 0;
+    while (heap.count > 0 && dict_size < KLASS_MODEL_DICT_CAPACITY) {
+        Dict_Candidate top = dict_heap_pop(&heap);
+        Nob_String_View text = train_samples.items[top.index].text;
+        float gain = dict_gain(covered, text);
+        if (heap.count > 0 && gain < heap.items[0].gain) {
+            top.gain = gain;
+            dict_heap_push(&heap, top);
+            continue;
+        }
+        if (gain <= 0) break;
+
+        for (size_t i = 0; i + KLASS_MODEL_NGRAM <= text.count; ++i) {
+            uint32_t h = ngram_hash(text.data + i);
+            covered[h/8] |= 1 << h%8;
+        }
+        nob_da_append(&picked, top.index);
+        dict_size += text.count + 1;
+    }
+
+    // deflate can reference the end of the dictionary with shorter distances, so the most
+    // valuable samples, which are picked first, go last
+    model->dict.count = 0;
+    for (size_t i = picked.count; i > 0; --i) {
+        Nob_String_View text = train_samples.items[picked.items[i - 1]].text;
+        nob_sb_append_buf(&model->dict, text.data, text.count);
+        nob_sb_append_buf(&model->dict, " ", 1);
+    }
+    if (model->dict.count > KLASS_MODEL_DICT_CAPACITY) {
+        size_t extra = model->dict.count - KLASS_MODEL_DICT_CAPACITY;
+        memmove(model->dict.items, model->dict.items + extra, KLASS_MODEL_DICT_CAPACITY);
+        model->dict.count = KLASS_MODEL_DICT_CAPACITY;
+    }
+    model->samples_used = picked.count;
+
+    free(picked.items);
+    nob_da_free(heap);
+    free(covered);
+}
+
+void klass_models_init(Klass_Models *km, Samples train_samples, int level)
+{
+    memset(km, 0, sizeof(*km));
+    km->level = level;
+    for (size_t klass = 0; klass < NOB_ARRAY_LEN(km->models); ++klass) {
+        Klass_Model *model = &km->models[klass];
+        klass_model_build_dict(model, train_samples, klass);
+        int ret = deflateInit(&model->stream, level);
+        if (ret != Z_OK) {
+            nob_log(NOB_ERROR, "Could not initialize deflate with level %d: %s", level, zError(ret));
+            abort();
+        }
+        nob_log(NOB_INFO, "Class %s: dictionary of %zu bytes from %zu samples", klass_names[klass], model->dict.count, model->samples_used);
+    }
+}
+
+// Compressed size of the text with the dictionary of the class
+size_t klass_model_compressed_size(Klass_Models *km, size_t klass, Nob_String_View text)
+{
+    Klass_Model *model = &km->models[klass];
+    deflateReset(&model->stream);
+    int ret = deflateSetDictionary(&model->stream, (const Bytef *)model->dict.items, model->dict.count);
+    if (ret != Z_OK) {
+        nob_log(NOB_ERROR, "Could not set the deflate dictionary of class %s: %s", klass_names[klass], zError(ret));
+        abort();
+    }
+
+    size_t output_size = deflateBound(&model->stream, text.count);
+    if (km->output.capacity < output_size) {
+        km->output.items = realloc(km->output.items, output_size);
+        assert(km->output.items != NULL);
+        km->output.capacity = output_size;
+    }
+
+    model->stream.avail_in = (uInt)text.count;
+    model->stream.next_in = (Bytef *)text.data;
+    model->stream.avail_out = (uInt)output_size;
+    model->stream.next_out = (Bytef *)km->output.items;
+    int result = deflate(&model->stream, Z_FINISH);
+    assert(result == Z_STREAM_END && "Probably not enough output buffer was allocated");
+    return model->stream.total_out;
+}
+
+void klass_models_free(Klass_Models *km)
+{
+    for (size_t klass = 0; klass < NOB_ARRAY_LEN(km->models); ++klass) {
+        Klass_Model *model = &km->models[klass];
+        deflateEnd(&model->stream);
+        nob_sb_free(model->dict);
+    }
+    nob_sb_free(km->output);
+    memset(km, 0, sizeof(*km));
+}
+
+size_t klass_models_predict(Klass_Models *km, Nob_String_View text)
+{
+    size_t predicted_klass = 0;
+    size_t best_size = SIZE_MAX;
+    for (size_t klass = 0; klass < NOB_ARRAY_LEN(km->models); ++klass) {
+        size_t size = klass_model_compressed_size(km, klass, text);
+        if (size < best_size) {
+            best_size = size;
+            predicted_klass = klass;
+        }
+    }
+    return predicted_klass;
+}
+
+// Type-ahead classification: the query grows a few characters at a time and every training
+// sample keeps the LZ77 state (hash chains and symbol prices, see Lz77_Cost) of the
+// concatenation "<train text> <query>" parsed so far. Appending characters only parses the new
+// positions, so the cost of a keystroke depends on the amount of added characters rather than
+// on the length of the train text and the query. The parse and the pricing are the same as in
+// lz77_compressed_size(), so the distances are bit-equal to the lz77 NCD of the train text and
+// the query, except for the train texts cut to fit the 16 bit positions (see typeahead_session_begin()).
+//
+// The symbols are committed only once more data can not change them: a literal once 3 bytes
+// are known after it, a match once it stops short of the end of the data. The uncommitted tail
+// (at most LZ77_MAX_MATCH bytes) is priced provisionally on every keystroke and rolled back.
+#define TYPEAHEAD_MAX_QUERY 512
+#define TYPEAHEAD_EMPTY UINT16_MAX
+
+typedef struct {
+    const Sample *sample;
+    Nob_String_View train;
+    float ca;
+
+    uint16_t *head;
+    uint16_t *prev;
+    uint32_t hash_mask;
+    // First position whose symbol is not final yet
+    uint16_t pos;
+    // First position not inserted into the hash chains yet
+    uint16_t inserted;
+    Lz77_Cost cost;
+} Typeahead_State;
+
+typedef struct Typeahead_Session Typeahead_Session;
+
+typedef struct {
+    Typeahead_Session *ts;
+    size_t index;
+    Arena arena;
+} Typeahead_Job;
+
+struct Typeahead_Session {
+    Klass_Predictor *kp;
+    int level;
+    size_t max_chain;
+
+    Nob_String_Builder query;
+    float cb;
+
+    Typeahead_State *states;
+    size_t states_count;
+    NCD *distances;
+    NCDs ncds;
+    Arena arena;
+    // Reset on every keystroke
+    Arena scratch;
+
+    // The workers live as long as the session, a keystroke only wakes them up for a new round
+    pthread_t *threads;
+    Typeahead_Job *jobs;
+    size_t workers;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    size_t round;
+    size_t pending;
+    bool init;
+    bool quit;
+};
+
+static inline uint8_t typeahead_byte(const Typeahead_State *s, const char *query, size_t i)
+{
+    if (i < s->train.count) return s->train.data[i];
+    if (i == s->train.count) return ' ';
+    return query[i - s->train.count - 1];
+}
+
+static inline uint32_t typeahead_hash(const Typeahead_State *s, const char *query, size_t i)
+{
+    return ((((uint32_t)typeahead_byte(s, query, i) << 16) ^ ((uint32_t)typeahead_byte(s, query, i + 1) << 8) ^ typeahead_byte(s, query, i + 2))*2654435761u >> 8) & s->hash_mask;
+}
+
+typedef struct {
+    uint32_t hash;
+    uint16_t head;
+} Typeahead_Undo;
+
+// Inserts all the positions below `upto` that have enough data after them into the hash chains
+static size_t typeahead_insert(Typeahead_State *s, const char *query, size_t n, size_t upto, Typeahead_Undo *undo, size_t undo_count)
+{
+    while (s->inserted < upto && (size_t)s->inserted + LZ77_MIN_MATCH <= n) {
+        uint32_t h = typeahead_hash(s, query, s->inserted);
+        if (undo != NULL) undo[undo_count++] = (Typeahead_Undo) {.hash = h, .head = s->head[h]};
+        s->prev[s->inserted] = s->head[h];
+        s->head[h] = s->inserted;
+        s->inserted += 1;
+    }
+    return undo_count;
+}
+
+static size_t typeahead_longest_match(const Typeahead_State *s, const char *query, size_t n, size_t i, size_t max_chain, size_t *dist)
+{
+    size_t best_len = 0;
+    size_t max_len = n - i;
+    if (max_len > LZ77_MAX_MATCH) max_len = LZ77_MAX_MATCH;
+    uint16_t j = s->head[typeahead_hash(s, query, i)];
+    for (size_t chain = 0; j != TYPEAHEAD_EMPTY && chain < max_chain && i - j <= LZ77_WINDOW_SIZE; j = s->prev[j]) {
+        // The same chain depth accounting as in lz77_compressed_size()
+        if (typeahead_byte(s, query, j) != typeahead_byte(s, query, i) ||
+            typeahead_byte(s, query, j + 1) != typeahead_byte(s, query, i + 1) ||
+            typeahead_byte(s, query, j + 2) != typeahead_byte(s, query, i + 2)) continue;
+        chain += 1;
+        if (typeahead_byte(s, query, j + best_len) != typeahead_byte(s, query, i + best_len)) continue;
+        size_t len = 0;
+        while (len < max_len && typeahead_byte(s, query, j + len) == typeahead_byte(s, query, i + len)) len += 1;
+        if (len > best_len) {
+            best_len = len;
+            *dist = i - j;
+            if (len == max_len) break;
+        }
+    }
+    return best_len;
+}
+
+// Commits all of the symbols that can not change anymore
+static void typeahead_commit(Typeahead_State *s, const char *query, size_t n, size_t max_chain)
+{
+    while (s->pos < n) {
+        typeahead_insert(s, query, n, s->pos, NULL, 0);
+        if ((size_t)s->pos + LZ77_MIN_MATCH > n) break;
+        size_t dist = 0;
+        size_t len = typeahead_longest_match(s, query, n, s->pos, max_chain, &dist);
+        if (len >= LZ77_MIN_MATCH) {
+            if (s->pos + len == n && len < LZ77_MAX_MATCH) break;
+            lz77_cost_match(&s->cost, len, dist);
+            s->pos += len;
+        } else {
+            lz77_cost_literal(&s->cost, typeahead_byte(s, query, s->pos));
+            s->pos += 1;
+        }
+    }
+}
+
+// Prices the committed symbols together with the provisional parse of the tail
+static size_t typeahead_estimate(Typeahead_State *s, const char *query, size_t n, size_t max_chain)
+{
+    Typeahead_Undo undo[LZ77_MAX_MATCH + LZ77_MIN_MATCH];
+    size_t undo_count = 0;
+    uint16_t inserted = s->inserted;
+    Lz77_Cost cost = s->cost;
+
+    size_t i = s->pos;
+    while (i < n) {
+        undo_count = typeahead_insert(s, query, n, i, undo, undo_count);
+        size_t dist = 0;
+        size_t len = i + LZ77_MIN_MATCH <= n ? typeahead_longest_match(s, query, n, i, max_chain, &dist) : 0;
+        if (len >= LZ77_MIN_MATCH) {
+            lz77_cost_match(&cost, len, dist);
+            i += len;
+        } else {
+            lz77_cost_literal(&cost, typeahead_byte(s, query, i));
+            i += 1;
+        }
+    }
+
+    while (undo_count > 0) {
+        undo_count -= 1;
+        s->head[undo[undo_count].hash] = undo[undo_count].head;
+    }
+    s->inserted = inserted;
+    return lz77_cost_size(&cost);
+}
+
+static void typeahead_job_run(Typeahead_Job *job, bool init)
+{
+    Typeahead_Session *ts = job->ts;
+    size_t query_count = ts->query.count;
+    size_t begin = ts->states_count*job->index/ts->workers;
+    size_t end = ts->states_count*(job->index + 1)/ts->workers;
+    for (size_t i = begin; i < end; ++i) {
+        Typeahead_State *s = &ts->states[i];
+        if (init) {
+            s->ca = lz77_compressed_size(&job->arena, s->train, ts->level);
+            arena_reset(&job->arena);
+            memset(s->head, 0xFF, (s->hash_mask + 1)*sizeof(*s->head));
+            s->pos = 0;
+            s->inserted = 0;
+            lz77_cost_init(&s->cost);
+        }
+
+        size_t n = s->train.count + 1 + query_count;
+        typeahead_commit(s, ts->query.items, n, ts->max_chain);
+        float cab = typeahead_estimate(s, ts->query.items, n, ts->max_chain);
+        float mn = s->ca; if (mn > ts->cb) mn = ts->cb;
+        float mx = s->ca; if (mx < ts->cb) mx = ts->cb;
+        ts->distances[i] = (NCD) {
+            .distance = (cab - mn)/mx,
+            .klass = s->sample->klass,
+            .sample = s->sample,
+        };
+    }
+}
+
+void *typeahead_thread(void *params)
+{
+    Typeahead_Job *job = params;
+    Typeahead_Session *ts = job->ts;
+    size_t round = 0;
+    pthread_mutex_lock(&ts->lock);
+    for (;;) {
+        while (ts->round == round && !ts->quit) pthread_cond_wait(&ts->start, &ts->lock);
+        if (ts->quit) break;
+        round = ts->round;
+        bool init = ts->init;
+        pthread_mutex_unlock(&ts->lock);
+
+        typeahead_job_run(job, init);
+
+        pthread_mutex_lock(&ts->lock);
+        ts->pending -= 1;
+        if (ts->pending == 0) pthread_cond_signal(&ts->done);
+    }
+    pthread_mutex_unlock(&ts->lock);
+    return NULL;
+}
+
+static void typeahead_workers_start(Typeahead_Session *ts)
+{
+    ts->workers = ts->kp->nprocs;
+    ts->threads = malloc(ts->workers*sizeof(*ts->threads));
+    ts->jobs = calloc(ts->workers, sizeof(*ts->jobs));
+    assert(ts->threads != NULL && ts->jobs != NULL);
+    pthread_mutex_init(&ts->lock, NULL);
+    pthread_cond_init(&ts->start, NULL);
+    pthread_cond_init(&ts->done, NULL);
+    ts->round = 0;
+    ts->quit = false;
+    for (size_t i = 0; i < ts->workers; ++i) {
+        ts->jobs[i].ts = ts;
+        ts->jobs[i].index = i;
+        if (pthread_create(&ts->threads[i], NULL, typeahead_thread, &ts->jobs[i]) != 0) {
+            nob_log(NOB_ERROR, "Could not create thread");
+            exit(1);
+        }
+    }
+}
+
+static void typeahead_workers_stop(Typeahead_Session *ts)
+{
+    if (ts->threads == NULL) return;
+    pthread_mutex_lock(&ts->lock);
+    ts->quit = true;
+    pthread_cond_broadcast(&ts->start);
+    pthread_mutex_unlock(&ts->lock);
+    for (size_t i = 0; i < ts->workers; ++i) {
+        if (pthread_join(ts->threads[i], NULL) != 0) {
+            nob_log(NOB_ERROR, "Could not join thread");
+            exit(1);
+        }
+        arena_free(&ts->jobs[i].arena);
+    }
+    pthread_mutex_destroy(&ts->lock);
+    pthread_cond_destroy(&ts->start);
+    pthread_cond_destroy(&ts->done);
+    free(ts->threads);
+    free(ts->jobs);
+    ts->threads = NULL;
+    ts->jobs = NULL;
+}
+
+static void typeahead_run(Typeahead_Session *ts, bool init)
+{
+    arena_reset(&ts->scratch);
+    ts->cb = lz77_compressed_size(&ts->scratch, nob_sv_from_parts(ts->query.items, ts->query.count), ts->level);
+
+    if (ts->threads == NULL) typeahead_workers_start(ts);
+    pthread_mutex_lock(&ts->lock);
+    ts->init = init;
+    ts->pending = ts->workers;
+    ts->round += 1;
+    pthread_cond_broadcast(&ts->start);
+    while (ts->pending > 0) pthread_cond_wait(&ts->done, &ts->lock);
+    pthread_mutex_unlock(&ts->lock);
+}
+
+// Prepares the per sample states for all the train samples of the predictor. Always uses the
+// lz77 estimator, with the level of the predictor's compressor if it is lz77 as well.
+void typeahead_session_begin(Typeahead_Session *ts, Klass_Predictor *kp)
+{
+    if (ts->threads != NULL && ts->workers != kp->nprocs) typeahead_workers_stop(ts);
+    ts->kp = kp;
+    ts->level = kp->compressor.compressed_size == lz77_compressed_size ? kp->compressor.level : find_compressor("lz77")->level;
+    ts->max_chain = (size_t)1 << (ts->level < 0 ? 0 : ts->level > LZ77_MAX_LEVEL ? LZ77_MAX_LEVEL : ts->level);
+    ts->query.count = 0;
+
+    arena_reset(&ts->arena);
+    ts->states_count = train_set_snapshot(&kp->train);
+    ts->states = arena_alloc_aligned(&ts->arena, ts->states_count*sizeof(*ts->states), CACHE_LINE_SIZE);
+    ts->distances = arena_alloc_aligned(&ts->arena, ts->states_count*sizeof(*ts->distances), CACHE_LINE_SIZE);
+    for (size_t i = 0; i < ts->states_count; ++i) {
+        Typeahead_State *s = &ts->states[i];
+        memset(s, 0, sizeof(*s));
+        s->sample = train_set_get(&kp->train, i);
+        s->train = s->sample->text;
+        // Positions are 16 bit
+        if (s->train.count > TYPEAHEAD_EMPTY - 1 - TYPEAHEAD_MAX_QUERY) s->train.count = TYPEAHEAD_EMPTY - 1 - TYPEAHEAD_MAX_QUERY;
+        size_t capacity = s->train.count + 1 + TYPEAHEAD_MAX_QUERY;
+        size_t hash_size = 64;
+        while (hash_size < capacity) hash_size *= 2;
+        s->hash_mask = hash_size - 1;
+        s->head = arena_alloc(&ts->arena, hash_size*sizeof(*s->head));
+        s->prev = arena_alloc(&ts->arena, capacity*sizeof(*s->prev));
+    }
+
+    typeahead_run(ts, true);
+}
+
+// Appends the characters to the query and returns the class predicted for the whole query so far
+size_t typeahead_session_append(Typeahead_Session *ts, Nob_String_View chars, size_t k)
+{
+    if (ts->query.count + chars.count > TYPEAHEAD_MAX_QUERY) {
+        nob_log(NOB_WARNING, "Type-ahead query is limited to %d bytes", TYPEAHEAD_MAX_QUERY);
+        chars.count = TYPEAHEAD_MAX_QUERY - ts->query.count;
+    }
+    nob_sb_append_buf(&ts->query, chars.data, chars.count);
+    typeahead_run(ts, false);
+
+    ts->ncds.count = 0;
+    nob_da_append_many(&ts->ncds, ts->distances, ts->states_count);
+    qsort(ts->ncds.items, ts->ncds.count, sizeof(*ts->ncds.items), compare_ncds);
+    return klass_vote(ts->ncds, k);
+}
+
+void typeahead_session_end(Typeahead_Session *ts)
+{
+    typeahead_workers_stop(ts);
+    arena_free(&ts->arena);
+    arena_free(&ts->scratch);
+    nob_sb_free(ts->query);
+    nob_da_free(ts->ncds);
+    memset(ts, 0, sizeof(*ts));
+}
+
+// Resumable evaluation. Every classified test sample is appended to the checkpoint file as
+// "<index>,<predicted>,<actual>,<secs>,<prefix klass>,<prefix secs>,<refine secs>" and the
+// file is flushed every CHECKPOINT_INTERVAL_SECS, so a restarted evaluation skips the samples
+// that are already there and rebuilds the aggregate metrics out of them.
+#define CHECKPOINT_INTERVAL_SECS 5.0
+#define CHECKPOINT_MAGIC "knn-checkpoint"
+
+typedef struct {
+    size_t index;
+    size_t predicted_klass;
+    size_t actual_klass;
+    double secs;
+    size_t prefix_klass;
+    double prefix_secs;
+    double refine_secs;
+} Eval_Record;
+
+typedef struct {
+    size_t count;
+    size_t success;
+    size_t prefix_success;
+    double secs;
+    double prefix_secs;
+    double refine_secs;
+} Eval_Stats;
+
+void eval_stats_add(Eval_Stats *stats, const Eval_Record *record)
+{
+    stats->count += 1;
+    if (record->predicted_klass == record->actual_klass) stats->success += 1;
+    if (record->prefix_klass == record->actual_klass) stats->prefix_success += 1;
+    stats->secs += record->secs;
+    stats->prefix_secs += record->prefix_secs;
+    stats->refine_secs += record->refine_secs;
+}
+
+typedef struct {
+    FILE *f;
+    double last_flush;
+} Checkpoint;
+
+// The first line of the checkpoint. The records are only valid for the same test set size, train
+// file and predictor setup, so a checkpoint is resumed only when its header is exactly the same.
+// The train path goes last since it may contain spaces.
+char *checkpoint_header(const Klass_Predictor *kp, const char *train_path, size_t samples_count)
+{
+    char *train_realpath = realpath(train_path, NULL);
+    char *header = nob_temp_sprintf(CHECKPOINT_MAGIC" %zu %s %d %zu %zu %s\n", samples_count,
+                                    kp->compressor.name, kp->compressor.level, kp->prefix, kp->refine,
+                                    train_realpath != NULL ? train_realpath : train_path);
+    free(train_realpath);
+    return header;
+}
+
+// Loads the records of an existing checkpoint marking the samples as done and opens it for appending.
+// A record torn by an interruption in the middle of the write is dropped.
+bool checkpoint_open(Checkpoint *cp, const char *path, const char *header, size_t samples_count, bool *done, Eval_Stats *stats)
+{
+
+    Nob_String_Builder content = {0};
+    bool exists = access(path, F_OK) == 0;
+    if (exists && !nob_read_entire_file(path, &content)) return false;
+
+    size_t valid = 0;
+    if (content.count > 0) {
+        nob_sb_append_null(&content);
+        size_t header_size = strlen(header);
+        if (content.count <= header_size || memcmp(content.items, header, header_size) != 0) {
+            char *line_end = strchr(content.items, '\n');
+            nob_log(NOB_ERROR, "Checkpoint %s was made for a different evaluation", path);
+            nob_log(NOB_ERROR, "    expected: %.*s", (int)header_size - 1, header);
+            nob_log(NOB_ERROR, "    found:    %.*s", line_end != NULL ? (int)(line_end - content.items) : (int)strlen(content.items), content.items);
+            nob_sb_free(content);
+            return false;
+        }
+        char *line = content.items;
+        while (true) {
+            char *line_end = strchr(line, '\n');
+            if (line_end == NULL) break;
+            Eval_Record r = {0};
+            if (line != content.items) {
+                int n = sscanf(line, "%zu,%zu,%zu,%lf,%zu,%lf,%lf", &r.index, &r.predicted_klass, &r.actual_klass, &r.secs, &r.prefix_klass, &r.prefix_secs, &r.refine_secs);
+                if (n != 7 || r.index >= samples_count) {
+                    nob_log(NOB_ERROR, "%s:%zu: invalid checkpoint record", path, valid);
+                    nob_sb_free(content);
+                    return false;
+                }
+                if (!done[r.index]) {
+                    done[r.index] = true;
+                    eval_stats_add(stats, &r);
+                }
+            }
+            line = line_end + 1;
+            valid = line - content.items;
+        }
+        nob_sb_free(content);
+        if (truncate(path, valid) < 0) {
+            nob_log(NOB_ERROR, "Could not truncate checkpoint %s: %s", path, strerror(errno));
+            return false;
+        }
+    }
+
+    cp->f = fopen(path, "a");
+    if (cp->f == NULL) {
+        nob_log(NOB_ERROR, "Could not open checkpoint %s: %s", path, strerror(errno));
+        return false;
+    }
+    if (valid == 0) fputs(header, cp->f);
+    cp->last_flush = clock_get_secs();
+    return true;
+}
+
+void checkpoint_write(Checkpoint *cp, const Eval_Record *r)
+{
+    fprintf(cp->f, "%zu,%zu,%zu,%.6lf,%zu,%.6lf,%.6lf\n", r->index, r->predicted_klass, r->actual_klass, r->secs, r->prefix_klass, r->prefix_secs, r->refine_secs);
+    double now = clock_get_secs();
+    if (now - cp->last_flush >= CHECKPOINT_INTERVAL_SECS) {
+        fflush(cp->f);
+        cp->last_flush = now;
+    }
+}
+
+void checkpoint_close(Checkpoint *cp)
+{
+    fclose(cp->f);
+    cp->f = NULL;
+}
+
+// Sequential evaluation visits the test samples in random order and stops once the 95%
+// Wilson score interval of the accuracy is narrow enough. Checking the interval after every
+// sample makes its coverage slightly optimistic, which is fine for routine comparisons.
+#define EVAL_CONFIDENCE_Z 1.96
+
+// Half-width of the Wilson score interval of `success` out of `count`
+double eval_interval(size_t success, size_t count, double *center)
+{
+    double n = count;
+    double p = (double)success/n;
+    double z2 = EVAL_CONFIDENCE_Z*EVAL_CONFIDENCE_Z;
+    double denom = 1 + z2/n;
+    *center = (p + z2/(2*n))/denom;
+    return EVAL_CONFIDENCE_Z*sqrt(p*(1 - p)/n + z2/(4*n*n))/denom;
+}
+
+char buffer[512];
+
+void usage(const char *program)
+{
+    nob_log(NOB_ERROR, "Usage: %s [flags] <train.csv> [test.csv]", program);
+    nob_log(NOB_ERROR, "       %s [flags] matrix [-f16] [-tile <size>] <output.bin> <train.csv> [test.csv]", program);
+    nob_log(NOB_ERROR, "       %s [flags] shards <count> <train.csv> [test.csv]", program);
+    nob_log(NOB_ERROR, "       %s [flags] klassmodels <train.csv> <test.csv>", program);
+    nob_log(NOB_ERROR, "       %s [flags] typeahead <train.csv> [test.csv]", program);
+    nob_log(NOB_ERROR, "       %s tlbbench <train.csv>", program);
+    nob_log(NOB_ERROR, "Flags:");
+    nob_log(NOB_ERROR, "    -prefix <bytes>   rank all train samples by the NCD of the first <bytes> of the texts first (default: 0, disabled)");
+    nob_log(NOB_ERROR, "    -refine <count>   recompute the exact NCD only for the best <count> samples of the prefix pass (default: %d)", DEFAULT_REFINE);
+    nob_log(NOB_ERROR, "    -compressor <name> compressor used to compute NCD (default: %s)", compressors[0].name);
+    for (size_t i = 0; i < NOB_ARRAY_LEN(compressors); ++i) {
+        nob_log(NOB_ERROR, "        %s (default level: %d, levels %d..%d)", compressors[i].name, compressors[i].level, compressors[i].min_level, compressors[i].max_level);
+    }
+    nob_log(NOB_ERROR, "    -level <level>    compression level of the selected compressor");
+    nob_log(NOB_ERROR, "    -threads <count>  amount of workers (default: CPUs in the affinity mask capped by the cgroup cpu.max quota)");
+    nob_log(NOB_ERROR, "    -pin              pin each worker to a distinct CPU");
+    nob_log(NOB_ERROR, "    -cache <bytes>    cache the predictions of the interactive and the -listen modes in at most <bytes> of memory (default: 0, disabled)");
+    nob_log(NOB_ERROR, "    -listen <path>    instead of the interactive mode serve the titles sent by any amount of clients over the Unix socket <path>, one per line");
+    nob_log(NOB_ERROR, "    -watch            rebuild the predictor in the background whenever the train file changes in the interactive mode");
+    nob_log(NOB_ERROR, "    -budget-bytes <bytes>   keep a class-stratified random sample of the train file within <bytes> of memory (default: 0, unlimited)");
+    nob_log(NOB_ERROR, "    -budget-samples <count> keep a class-stratified random sample of at most <count> train samples (default: 0, unlimited)");
+    nob_log(NOB_ERROR, "    -checkpoint <path> record the evaluated test samples in <path> and skip the ones already recorded there");
+    nob_log(NOB_ERROR, "    -huge-pages <thp|hugetlb> back the train set and the worker arenas with transparent huge pages, or with the huge page pool falling back to thp");
+    nob_log(NOB_ERROR, "    -precision <p>    evaluate the test samples in random order until the 95%% confidence interval of the accuracy is within +-<p>, e.g. 0.005 (default: 0, evaluate all)");
+}
+
+bool parse_size_flag(const char *program, const char *flag, int *argc, char ***argv, size_t *value)
+{
+    if (*argc <= 0) {
+        usage(program);
+        nob_log(NOB_ERROR, "No value is provided for flag %s", flag);
+        return false;
+    }
+    const char *arg = nob_shift_args(argc, argv);
+    char *endptr = NULL;
+    unsigned long long result = strtoull(arg, &endptr, 10);
+    if (*arg == '\0' || *endptr != '\0') {
+        usage(program);
+        nob_log(NOB_ERROR, "Invalid value `%s` for flag %s", arg, flag);
+        return false;
+    }
+    *value = result;
+    return true;
+}
+
+bool parse_float_flag(const char *program, const char *flag, int *argc, char ***argv, double *value)
+{
+    if (*argc <= 0) {
+        usage(program);
+        nob_log(NOB_ERROR, "No value is provided for flag %s", flag);
+        return false;
+    }
+    const char *arg = nob_shift_args(argc, argv);
+    char *endptr = NULL;
+    double result = strtod(arg, &endptr);
+    if (*arg == '\0' || *endptr != '\0' || result < 0) {
+        usage(program);
+        nob_log(NOB_ERROR, "Invalid value `%s` for flag %s", arg, flag);
+        return false;
+    }
+    *value = result;
+    return true;
+}
+
+// Goes through the cache if there is one
+size_t predict_title(Hot_Predictor *hp, Query_Cache *qc, Arena *arena, Nob_String_View text)
+{
+    size_t predicted_klass;
+    if (qc != NULL) {
+        predicted_klass = query_cache_predict(qc, arena, text);
+        arena_reset(arena);
+        arena_trim(arena, SCRATCH_ARENA_RETAIN);
+    } else {
+        Klass_Predictor *kp = hot_predictor_acquire(hp);
+        predicted_klass = klass_predictor_predict(kp, text, K);
+        hot_predictor_release(hp, kp);
+    }
+    return predicted_klass;
+}
+
+void interactive_mode(Hot_Predictor *hp, Query_Cache *qc)
+{
+    Arena arena = {0};
+    nob_log(NOB_INFO, "Provide News Title (or \"/add <class index>,<title>\" to add a new train sample):");
+    while (fgets(buffer, sizeof(buffer), stdin)) {
+        Nob_String_View line = nob_sv_trim(nob_sv_from_cstr(buffer));
+        if (line.count >= 5 && memcmp(line.data, "/add ", 5) == 0) {
+            line = nob_sv_trim(nob_sv_from_parts(line.data + 5, line.count - 5));
+            Nob_String_View klass = nob_sv_chop_by_delim(&line, ',');
+            if (klass.count != 1 || *klass.data < '1' || (size_t)(*klass.data - '1') >= NOB_ARRAY_LEN(klass_names)) {
+                nob_log(NOB_ERROR, "Invalid class index "SV_Fmt, SV_Arg(klass));
+                continue;
+            }
+            double begin = clock_get_secs();
+            Klass_Predictor *kp = hot_predictor_acquire(hp);
+            klass_predictor_add(kp, *klass.data - '1', line);
+            size_t train_count = train_set_snapshot(&kp->train);
+            hot_predictor_release(hp, kp);
+            if (qc != NULL) query_cache_clear(qc);
+            double end = clock_get_secs();
+            nob_log(NOB_INFO, "Added %s sample, %zu train samples in total (%.3lfsecs)", klass_names[*klass.data - '1'], train_count, end - begin);
+            continue;
+        }
+
+        double begin = clock_get_secs();
+        size_t predicted_klass = predict_title(hp, qc, &arena, nob_sv_from_cstr(buffer));
+        double end = clock_get_secs();
+        nob_log(NOB_INFO, "Topic: %s (%.3lfsecs)", klass_names[predicted_klass], end - begin);
+        if (qc != NULL) query_cache_log_stats(qc);
+    }
+    arena_free(&arena);
+}
+
+// Serves the predictions over a Unix socket, so several clients (e.g. one per news feed) query
+// the same predictor at the same time. Every line a client sends is a title, answered with the
+// name of the predicted class on its own line. Each client gets its own thread, so the identical
+// titles of different clients arriving while one of them is being computed are coalesced by the
+// cache.
+typedef struct {
+    Hot_Predictor *hp;
+    Query_Cache *qc;
+    // Without the cache the clients take turns on the predictor, which is not reentrant
+    pthread_mutex_t lock;
+} Server;
+
+typedef struct {
+    Server *server;
+    int fd;
+} Server_Client;
+
+void *server_client_thread(void *params)
+{
+    Server_Client *client = params;
+    Server *server = client->server;
+    FILE *f = fdopen(client->fd, "r");
+    if (f == NULL) {
+        nob_log(NOB_ERROR, "Could not open client %d: %s", client->fd, strerror(errno));
+        close(client->fd);
+        free(client);
+        return NULL;
+    }
+
+    Arena arena = {0};
+    // Not cut to a fixed buffer, so every line gets exactly one response
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_size;
+    while ((line_size = getline(&line, &line_capacity, f)) >= 0) {
+        Nob_String_View text = nob_sv_trim(nob_sv_from_parts(line, line_size));
+        if (text.count == 0) continue;
+
+        double begin = clock_get_secs();
+        if (server->qc == NULL) pthread_mutex_lock(&server->lock);
+        size_t predicted_klass = predict_title(server->hp, server->qc, &arena, text);
+        if (server->qc == NULL) pthread_mutex_unlock(&server->lock);
+        double end = clock_get_secs();
+        nob_log(NOB_INFO, "Client %d: %s (%.3lfsecs)", client->fd, klass_names[predicted_klass], end - begin);
+
+        char response[64];
+        int n = snprintf(response, sizeof(response), "%s\n", klass_names[predicted_klass]);
+        if (!write_all(client->fd, response, n)) break;
+    }
+    if (server->qc != NULL) query_cache_log_stats(server->qc);
+
+    free(line);
+    arena_free(&arena);
+    fclose(f);
+    free(client);
+    return NULL;
+}
+
+// Returns only if the socket could not be set up or stopped accepting the clients
+bool server_mode(Hot_Predictor *hp, Query_Cache *qc, const char *path)
+{
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        nob_log(NOB_ERROR, "Socket path %s is too long", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        nob_log(NOB_ERROR, "Could not create socket: %s", strerror(errno));
+        return false;
+    }
+    // Left behind by a previous run. Anything else at the path is not ours to remove.
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        nob_log(NOB_ERROR, "Could not listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    // A client going away in the middle of a response must not take the server down
+    signal(SIGPIPE, SIG_IGN);
+
+    Server server = {
+        .hp = hp,
+        .qc = qc,
+    };
+    pthread_mutex_init(&server.lock, NULL);
+    nob_log(NOB_INFO, "Listening on %s", path);
+    while (true) {
+        int client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            nob_log(NOB_ERROR, "Could not accept a client on %s: %s", path, strerror(errno));
+            break;
+        }
+        Server_Client *client = malloc(sizeof(*client));
+        assert(client != NULL);
+        client->server = &server;
+        client->fd = client_fd;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, server_client_thread, client) != 0) {
+            nob_log(NOB_ERROR, "Could not create thread for client %d", client_fd);
+            close(client_fd);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    close(fd);
+    return false;
+}
+
+bool matrix_command(const char *program, int argc, char **argv, const Compressor *c, size_t threads)
+{
+    size_t elem_size = sizeof(float);
+    size_t tile = NCD_MATRIX_DEFAULT_TILE;
+    while (argc > 0 && *argv[0] == '-') {
+        const char *flag = nob_shift_args(&argc, &argv);
+        if (strcmp(flag, "-f16") == 0) {
+            elem_size = sizeof(uint16_t);
+        } else if (strcmp(flag, "-tile") == 0) {
+            if (!parse_size_flag(program, flag, &argc, &argv, &tile)) return false;
+            if (tile == 0) {
+                usage(program);
+                nob_log(NOB_ERROR, "Tile size must be positive");
+                return false;
+            }
+        } else {
+            usage(program);
+            nob_log(NOB_ERROR, "Unknown matrix flag %s", flag);
+            return false;
+        }
+    }
+
+    if (argc < 2) {
+        usage(program);
+        nob_log(NOB_ERROR, "ERROR: matrix requires output file and train file");
+        return false;
+    }
+    const char *output_path = nob_shift_args(&argc, &argv);
+    const char *train_path = nob_shift_args(&argc, &argv);
+    Nob_String_Builder train_content = {0};
+    Samples rows = {0};
+    if (!load_samples(train_path, threads, &train_content, &rows)) return false;
+    Samples cols = rows;
+
+    Nob_String_Builder test_content = {0};
+    if (argc > 0) {
+        const char *test_path = nob_shift_args(&argc, &argv);
+        if (!load_samples(test_path, threads, &test_content, &cols)) return false;
+    }
+
+    Cpus cpus = {0};
+    size_t nprocs = threads > 0 ? threads : available_cpus(&cpus);
+    nob_log(NOB_INFO, "Workers: %zu", nprocs);
+    nob_log(NOB_INFO, "Compressor: %s (level %d)", c->name, c->level);
+
+    double begin = clock_get_secs();
+    bool ok = ncd_matrix_compute(output_path, rows, cols, c, tile, elem_size, nprocs);
+    nob_log(NOB_INFO, "Elapsed Time: %.3lfsecs", clock_get_secs() - begin);
+    return ok;
+}
+
+bool shards_command(const char *program, int argc, char **argv, const Klass_Predictor *config)
+{
+    size_t count = 0;
+    if (!parse_size_flag(program, "shards", &argc, &argv, &count)) return false;
+    if (count == 0) {
+        usage(program);
+        nob_log(NOB_ERROR, "Amount of shards must be positive");
+        return false;
+    }
+    if (argc <= 0) {
+        usage(program);
+        nob_log(NOB_ERROR, "ERROR: no train file is provided");
+        return false;
+    }
+    const char *train_path = nob_shift_args(&argc, &argv);
+    Nob_String_Builder train_content = {0};
+    Samples train_samples = {0};
+    if (!load_train_samples(config, train_path, &train_content, &train_samples)) return false;
+
+    Klass_Predictor shard_config = *config;
+    if (shard_config.nprocs == 0) {
+        Cpus cpus = {0};
+        shard_config.nprocs = available_cpus(&cpus)/count;
+        if (shard_config.nprocs == 0) shard_config.nprocs = 1;
+        nob_da_free(cpus);
+    }
+
+    Shards shards = {0};
+    if (!shards_start(&shards, &shard_config, train_samples, count)) return false;
 
     if (argc <= 0) {
-        interactive_mode(&kp);
+        nob_log(NOB_INFO, "Provide News Title:");
+        while (fgets(buffer, sizeof(buffer), stdin)) {
+            double begin = clock_get_secs();
+            size_t predicted_klass = shards_predict(&shards, nob_sv_from_cstr(buffer), K);
+            double end = clock_get_secs();
+            nob_log(NOB_INFO, "Topic: %s (%.3lfsecs)", klass_names[predicted_klass], end - begin);
+            shards_log_timing(&shards);
+        }
     } else {
         const char *test_path = nob_shift_args(&argc, &argv);
         Nob_String_Builder test_content = {0};
-        if (!nob_read_entire_file(test_path, &test_content)) return 1;
-        Samples test_samples = parse_samples(nob_sv_from_parts(test_content.items, test_content.count));
+        Samples test_samples = {0};
+        if (!load_samples(test_path, config->nprocs, &test_content, &test_samples)) return false;
 
         size_t success = 0;
         for (size_t i = 0; i < test_samples.count; ++i) {
@@ -245,19 +3378,546 @@ int main(int argc, char **argv)
             size_t actual_klass = test_samples.items[i].klass;
 
             double begin = clock_get_secs();
-            size_t predicted_klass = klass_predictor_predict(&kp, text, K);
+            size_t predicted_klass = shards_predict(&shards, text, K);
             double end = clock_get_secs();
             if (predicted_klass == actual_klass) success += 1;
             nob_log(NOB_INFO, "Text: "SV_Fmt, SV_Arg(text));
             nob_log(NOB_INFO, "Predicted Topic: %s", klass_names[predicted_klass]);
             nob_log(NOB_INFO, "Actual Topic: %s", klass_names[actual_klass]);
             nob_log(NOB_INFO, "Elapsed Time: %.3lfsecs", end - begin);
-            nob_log(NOB_INFO, "Success: %zu/%zu (%f)", success, test_samples.count, (float)success/test_samples.count);
+            shards_log_timing(&shards);
             nob_log(NOB_INFO, "Progress: %zu/%zu (%f)", i + 1, test_samples.count, (float)(i + 1)/test_samples.count);
             nob_log(NOB_INFO, "Success rate: %zu/%zu (%f)", success, i + 1, (float)success/(i + 1));
             nob_log(NOB_INFO, "");
         }
     }
 
+    shards_stop(&shards);
+    return true;
+}
+
+// Evaluates the class-level compression models against the kNN on the same test set
+bool klass_models_command(const char *program, int argc, char **argv, const Klass_Predictor *config)
+{
+    if (argc < 2) {
+        usage(program);
+        nob_log(NOB_ERROR, "ERROR: klassmodels requires train file and test file");
+        return false;
+    }
+    const char *train_path = nob_shift_args(&argc, &argv);
+    const char *test_path = nob_shift_args(&argc, &argv);
+
+    Klass_Predictor *kp = klass_predictor_load(config, train_path);
+    if (kp == NULL) return false;
+    Nob_String_Builder test_content = {0};
+    Samples test_samples = {0};
+    if (!load_samples(test_path, config->nprocs, &test_content, &test_samples)) return false;
+
+    int level = strcmp(config->compressor.name, "zlib") == 0 ? config->compressor.level : Z_BEST_COMPRESSION;
+    double begin = clock_get_secs();
+    Klass_Models km = {0};
+    klass_models_init(&km, kp->train_samples, level);
+    nob_log(NOB_INFO, "Class models built in %.3lfsecs", clock_get_secs() - begin);
+
+    size_t knn_success = 0;
+    size_t models_success = 0;
+    double knn_secs = 0;
+    double models_secs = 0;
+    for (size_t i = 0; i < test_samples.count; ++i) {
+        Nob_String_View text = test_samples.items[i].text;
+        size_t actual_klass = test_samples.items[i].klass;
+
+        double begin = clock_get_secs();
+        size_t knn_klass = klass_predictor_predict(kp, text, K);
+        double middle = clock_get_secs();
+        size_t models_klass = klass_models_predict(&km, text);
+        double end = clock_get_secs();
+
+        if (knn_klass == actual_klass) knn_success += 1;
+        if (models_klass == actual_klass) models_success += 1;
+        knn_secs += middle - begin;
+        models_secs += end - middle;
+
+        nob_log(NOB_INFO, "Text: "SV_Fmt, SV_Arg(text));
+        nob_log(NOB_INFO, "Actual Topic: %s", klass_names[actual_klass]);
+        nob_log(NOB_INFO, "kNN: %s (%.3lfsecs), success rate %zu/%zu (%f), average %.6lfsecs", klass_names[knn_klass], middle - begin, knn_success, i + 1, (float)knn_success/(i + 1), knn_secs/(i + 1));
+        nob_log(NOB_INFO, "Class Models: %s (%.6lfsecs), success rate %zu/%zu (%f), average %.6lfsecs", klass_names[models_klass], end - middle, models_success, i + 1, (float)models_success/(i + 1), models_secs/(i + 1));
+        nob_log(NOB_INFO, "Progress: %zu/%zu (%f)", i + 1, test_samples.count, (float)(i + 1)/test_samples.count);
+        nob_log(NOB_INFO, "");
+    }
+
+    klass_models_free(&km);
+    return true;
+}
+
+// Counts the distances of the session that are not bit-equal to the lz77 NCD of the train
+// texts and the query
+size_t typeahead_check(Typeahead_Session *ts)
+{
+    Compressor lz77 = *find_compressor("lz77");
+    lz77.level = ts->level;
+    Nob_String_View query = nob_sv_from_parts(ts->query.items, ts->query.count);
+    Arena arena = {0};
+    float cb = lz77_compressed_size(&arena, query, ts->level);
+    size_t mismatches = 0;
+    for (size_t i = 0; i < ts->states_count; ++i) {
+        const Typeahead_State *s = &ts->states[i];
+        float distance = ncd_with_sizes(&arena, &lz77, s->train, s->ca, query, cb);
+        if (distance != ts->distances[i].distance) mismatches += 1;
+        arena_reset(&arena);
+    }
+    arena_free(&arena);
+    return mismatches;
+}
+
+// Types the text into a fresh session one character at a time and returns the final prediction
+size_t typeahead_type(Typeahead_Session *ts, Klass_Predictor *kp, Nob_String_View text, double *keystroke_secs)
+{
+    double begin = clock_get_secs();
+    typeahead_session_begin(ts, kp);
+    double end = clock_get_secs();
+    nob_log(NOB_INFO, "Session: %.3lfsecs", end - begin);
+
+    size_t predicted_klass = 0;
+    double total_secs = 0;
+    for (size_t i = 0; i < text.count; ++i) {
+        begin = clock_get_secs();
+        predicted_klass = typeahead_session_append(ts, nob_sv_from_parts(text.data + i, 1), K);
+        end = clock_get_secs();
+        total_secs += end - begin;
+        nob_log(NOB_INFO, "%3zu: "SV_Fmt" -> %s (%.6lfsecs)", i + 1, (int)(i + 1), text.data, klass_names[predicted_klass], end - begin);
+    }
+    *keystroke_secs = text.count > 0 ? total_secs/text.count : 0;
+    return predicted_klass;
+}
+
+bool typeahead_command(const char *program, int argc, char **argv, const Klass_Predictor *config)
+{
+    if (argc <= 0) {
+        usage(program);
+        nob_log(NOB_ERROR, "ERROR: no train file is provided");
+        return false;
+    }
+    const char *train_path = nob_shift_args(&argc, &argv);
+    Klass_Predictor *kp = klass_predictor_load(config, train_path);
+    if (kp == NULL) return false;
+
+    Typeahead_Session ts = {0};
+    if (argc <= 0) {
+        nob_log(NOB_INFO, "Provide News Title:");
+        while (fgets(buffer, sizeof(buffer), stdin)) {
+            Nob_String_View text = nob_sv_trim(nob_sv_from_cstr(buffer));
+            double keystroke_secs = 0;
+            size_t predicted_klass = typeahead_type(&ts, kp, text, &keystroke_secs);
+            nob_log(NOB_INFO, "Topic: %s (%.6lfsecs per keystroke)", klass_names[predicted_klass], keystroke_secs);
+        }
+    } else {
+        const char *test_path = nob_shift_args(&argc, &argv);
+        Nob_String_Builder test_content = {0};
+        Samples test_samples = {0};
+        if (!load_samples(test_path, config->nprocs, &test_content, &test_samples)) return false;
+
+        size_t success = 0;
+        size_t mismatches = 0;
+        double keystroke_total = 0;
+        for (size_t i = 0; i < test_samples.count; ++i) {
+            Nob_String_View text = test_samples.items[i].text;
+            if (text.count > TYPEAHEAD_MAX_QUERY) text.count = TYPEAHEAD_MAX_QUERY;
+            size_t actual_klass = test_samples.items[i].klass;
+            double keystroke_secs = 0;
+            size_t predicted_klass = typeahead_type(&ts, kp, text, &keystroke_secs);
+            keystroke_total += keystroke_secs;
+            mismatches += typeahead_check(&ts);
+
+            double begin = clock_get_secs();
+            klass_predictor_predict(kp, text, K);
+            double full_secs = clock_get_secs() - begin;
+
+            if (predicted_klass == actual_klass) success += 1;
+            nob_log(NOB_INFO, "Predicted Topic: %s", klass_names[predicted_klass]);
+            nob_log(NOB_INFO, "Actual Topic: %s", klass_names[actual_klass]);
+            nob_log(NOB_INFO, "Keystroke: %.6lfsecs (average %.6lfsecs), full prediction: %.6lfsecs", keystroke_secs, keystroke_total/(i + 1), full_secs);
+            nob_log(NOB_INFO, "Success rate: %zu/%zu (%f)", success, i + 1, (float)success/(i + 1));
+            nob_log(NOB_INFO, "");
+        }
+        if (mismatches > 0) {
+            nob_log(NOB_ERROR, "%zu type-ahead distances differ from the lz77 NCD", mismatches);
+            typeahead_session_end(&ts);
+            return false;
+        }
+        nob_log(NOB_INFO, "All type-ahead distances match the lz77 NCD");
+    }
+    typeahead_session_end(&ts);
+    return true;
+}
+
+// Counts the dTLB load misses of the calling thread in the user space. Returns -1 when the
+// counter is not available, e.g. in a VM or a container without access to perf_event_open(2).
+int tlb_misses_counter_open(void)
+{
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+size_t anon_huge_pages_kb(void)
+{
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL) return 0;
+    char line[256];
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+#define TLB_BENCH_PASSES 5
+
+// Scans every byte of every train sample, in the order of the train set as the workers do and
+// in a random order, with the train content and the samples backed by the different kinds of pages
+bool tlb_bench_command(const char *program, int argc, char **argv)
+{
+    if (argc <= 0) {
+        usage(program);
+        nob_log(NOB_ERROR, "ERROR: no train file is provided");
+        return false;
+    }
+    const char *train_path = nob_shift_args(&argc, &argv);
+    Nob_String_Builder content = {0};
+    Samples samples = {0};
+    if (!load_samples(train_path, 0, &content, &samples)) return false;
+    nob_log(NOB_INFO, "Train set: %zu samples, %zu bytes", samples.count, content.count);
+
+    size_t *shuffled = malloc(samples.count*sizeof(*shuffled));
+    assert(samples.count == 0 || shuffled != NULL);
+    for (size_t i = 0; i < samples.count; ++i) shuffled[i] = i;
+    for (size_t i = samples.count; i > 1; --i) {
+        size_t j = rand()%i;
+        size_t t = shuffled[i - 1];
+        shuffled[i - 1] = shuffled[j];
+        shuffled[j] = t;
+    }
+
+    int counter = tlb_misses_counter_open();
+    if (counter < 0) nob_log(NOB_WARNING, "dTLB miss counter is not available: %s", strerror(errno));
+
+    struct {
+        const char *name;
+        Arena_Pages pages;
+    } modes[] = {
+        // Not the default pages, THP may back those as well when it is set to always
+        {"4KB", ARENA_PAGES_SMALL},
+        {"THP", ARENA_PAGES_HUGE},
+        {"HUGETLB", ARENA_PAGES_HUGETLB},
+    };
+    for (size_t m = 0; m < NOB_ARRAY_LEN(modes); ++m) {
+        size_t huge_kb_before = anon_huge_pages_kb();
+        size_t huge_kb = huge_kb_before;
+        Arena arena = {.pages = modes[m].pages};
+        Samples copy = {0};
+        arena_da_append_many(&arena, &copy, samples.items, samples.count);
+        samples_move_content(&arena, nob_sv_from_parts(content.items, content.count), copy);
+        huge_kb = anon_huge_pages_kb() - huge_kb;
+        if (arena.begin != NULL && arena.begin->pages != modes[m].pages) {
+            nob_log(NOB_INFO, "%s: not available, falls back to THP", modes[m].name);
+            arena_free(&arena);
+            continue;
+        }
+
+        for (size_t order = 0; order < 2; ++order) {
+            unsigned long long misses = 0;
+            if (counter >= 0) {
+                ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+                ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+            }
+            double begin = clock_get_secs();
+            size_t sum = 0;
+            for (size_t pass = 0; pass < TLB_BENCH_PASSES; ++pass) {
+                for (size_t i = 0; i < copy.count; ++i) {
+                    Nob_String_View text = copy.items[order == 0 ? i : shuffled[i]].text;
+                    for (size_t j = 0; j < text.count; ++j) sum += (uint8_t)text.data[j];
+                }
+            }
+            double end = clock_get_secs();
+            if (counter >= 0) {
+                ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) misses = 0;
+            }
+            char misses_str[64] = "n/a";
+            if (counter >= 0) snprintf(misses_str, sizeof(misses_str), "%llu", misses/TLB_BENCH_PASSES);
+            nob_log(NOB_INFO, "%-7s %-10s scan: %.6lfsecs, %s dTLB misses (AnonHugePages +%zukB, checksum %zu)",
+                    modes[m].name, order == 0 ? "sequential" : "random", (end - begin)/TLB_BENCH_PASSES,
+                    misses_str, huge_kb, sum);
+        }
+        size_t huge_kb_after = anon_huge_pages_kb();
+        if (modes[m].pages == ARENA_PAGES_SMALL && huge_kb_after > huge_kb_before) {
+            nob_log(NOB_WARNING, "%s: AnonHugePages grew by %zukB during the run, it is not a 4KB baseline",
+                    modes[m].name, huge_kb_after - huge_kb_before);
+        }
+        arena_free(&arena);
+    }
+
+    if (counter >= 0) close(counter);
+    free(shuffled);
+    nob_da_free(samples);
+    nob_sb_free(content);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const char *program = nob_shift_args(&argc, &argv);
+    srand(time(0));
+
+    size_t prefix = 0;
+    size_t refine = DEFAULT_REFINE;
+    Compressor compressor = compressors[0];
+    size_t level = 0;
+    bool level_provided = false;
+    size_t threads = 0;
+    bool pin = false;
+    size_t cache_bytes = 0;
+    const char *listen_path = NULL;
+    bool watch = false;
+    Sample_Budget budget = {0};
+    const char *checkpoint_path = NULL;
+    double precision = 0;
+    Arena_Pages pages = ARENA_PAGES_DEFAULT;
+    while (argc > 0 && *argv[0] == '-') {
+        const char *flag = nob_shift_args(&argc, &argv);
+        if (strcmp(flag, "-prefix") == 0) {
+            if (!parse_size_flag(program, flag, &argc, &argv, &prefix)) return 1;
+        } else if (strcmp(flag, "-refine") == 0) {
+            if (!parse_size_flag(program, flag, &argc, &argv, &refine)) return 1;
+        } else if (strcmp(flag, "-compressor") == 0) {
+            if (argc <= 0) {
+                usage(program);
+                nob_log(NOB_ERROR, "No value is provided for flag %s", flag);
+                return 1;
+            }
+            const char *name = nob_shift_args(&argc, &argv);
+            Compressor *c = find_compressor(name);
+            if (c == NULL) {
+                usage(program);
+                nob_log(NOB_ERROR, "Unknown compressor %s", name);
+                return 1;
+            }
+            compressor = *c;
+        } else if (strcmp(flag, "-level") == 0) {
+            if (!parse_size_flag(program, flag, &argc, &argv, &level)) return 1;
+            level_provided = true;
+        } else if (strcmp(flag, "-threads") == 0) {
+            if (!parse_size_flag(program, flag, &argc, &argv, &threads)) return 1;
+        } else if (strcmp(flag, "-pin") == 0) {
+            pin = true;
+        } else if (strcmp(flag, "-listen") == 0) {
+            if (argc <= 0) {
+                usage(program);
+                nob_log(NOB_ERROR, "No value is provided for flag %s", flag);
+                return 1;
+            }
+            listen_path = nob_shift_args(&argc, &argv);
+        } else if (strcmp(flag, "-cache") == 0) {
+            if (!parse_size_flag(program, flag, &argc, &argv, &cache_bytes)) return 1;
+        } else if (strcmp(flag, "-watch") == 0) {
+            watch = true;
+        } else if (strcmp(flag, "-budget-bytes") == 0) {
+            if (!parse_size_flag(program, flag, &argc, &argv, &budget.max_bytes)) return 1;
+        } else if (strcmp(flag, "-budget-samples") == 0) {
+            if (!parse_size_flag(program, flag, &argc, &argv, &budget.max_samples)) return 1;
+        } else if (strcmp(flag, "-checkpoint") == 0) {
+            if (argc <= 0) {
+                usage(program);
+                nob_log(NOB_ERROR, "No value is provided for flag %s", flag);
+                return 1;
+            }
+            checkpoint_path = nob_shift_args(&argc, &argv);
+        } else if (strcmp(flag, "-precision") == 0) {
+            if (!parse_float_flag(program, flag, &argc, &argv, &precision)) return 1;
+        } else if (strcmp(flag, "-huge-pages") == 0) {
+            if (argc <= 0) {
+                usage(program);
+                nob_log(NOB_ERROR, "No value is provided for flag %s", flag);
+                return 1;
+            }
+            const char *value = nob_shift_args(&argc, &argv);
+            if (strcmp(value, "thp") == 0) {
+                pages = ARENA_PAGES_HUGE;
+            } else if (strcmp(value, "hugetlb") == 0) {
+                pages = ARENA_PAGES_HUGETLB;
+            } else {
+                usage(program);
+                nob_log(NOB_ERROR, "Unknown huge pages kind %s", value);
+                return 1;
+            }
+        } else {
+            usage(program);
+            nob_log(NOB_ERROR, "Unknown flag %s", flag);
+            return 1;
+        }
+    }
+
+    if (prefix > 0 && refine < K) {
+        usage(program);
+        nob_log(NOB_ERROR, "-refine must be at least %d with -prefix, otherwise there are not enough candidates to vote", K);
+        return 1;
+    }
+
+    if (level_provided) {
+        if (level < (size_t)compressor.min_level || level > (size_t)compressor.max_level) {
+            usage(program);
+            nob_log(NOB_ERROR, "Level %zu is out of range %d..%d of compressor %s", level, compressor.min_level, compressor.max_level, compressor.name);
+            return 1;
+        }
+        compressor.level = level;
+    }
+
+    if (argc > 0 && strcmp(argv[0], "tlbbench") == 0) {
+        nob_shift_args(&argc, &argv);
+        return tlb_bench_command(program, argc, argv) ? 0 : 1;
+    }
+
+    if (argc > 0 && strcmp(argv[0], "matrix") == 0) {
+        nob_shift_args(&argc, &argv);
+        return matrix_command(program, argc, argv, &compressor, threads) ? 0 : 1;
+    }
+
+    Klass_Predictor config = {0};
+    config.nprocs = threads;
+    config.pin = pin;
+    config.prefix = prefix;
+    config.refine = refine;
+    config.compressor = compressor;
+    config.budget = budget;
+    config.pages = pages;
+
+    if (argc > 0 && strcmp(argv[0], "shards") == 0) {
+        nob_shift_args(&argc, &argv);
+        return shards_command(program, argc, argv, &config) ? 0 : 1;
+    }
+
+    if (argc > 0 && strcmp(argv[0], "typeahead") == 0) {
+        nob_shift_args(&argc, &argv);
+        return typeahead_command(program, argc, argv, &config) ? 0 : 1;
+    }
+
+    if (argc > 0 && strcmp(argv[0], "klassmodels") == 0) {
+        nob_shift_args(&argc, &argv);
+        return klass_models_command(program, argc, argv, &config) ? 0 : 1;
+    }
+
+    if (argc <= 0) {
+        usage(program);
+        nob_log(NOB_ERROR, "ERROR: no train file is provided");
+        return 1;
+    }
+    const char *train_path = nob_shift_args(&argc, &argv);
+    Klass_Predictor *kp = klass_predictor_load(&config, train_path);
+    if (kp == NULL) return 1;
+    nob_log(NOB_INFO, "Workers: %zu%s", kp->nprocs, kp->pin ? " (pinned)" : "");
+    nob_log(NOB_INFO, "Compressor: %s (level %d)", kp->compressor.name, kp->compressor.level);
+
+    if (argc <= 0) {
+        Hot_Predictor hp = {0};
+        hot_predictor_init(&hp, kp);
+        if (watch && !hot_predictor_watch(&hp, train_path)) return 1;
+        Query_Cache qc = {0};
+        if (cache_bytes > 0) query_cache_init(&qc, &hp, K, cache_bytes);
+        if (listen_path != NULL) return server_mode(&hp, cache_bytes > 0 ? &qc : NULL, listen_path) ? 0 : 1;
+        interactive_mode(&hp, cache_bytes > 0 ? &qc : NULL);
+    } else {
+        const char *test_path = nob_shift_args(&argc, &argv);
+        Nob_String_Builder test_content = {0};
+        Samples test_samples = {0};
+        if (!load_samples(test_path, config.nprocs, &test_content, &test_samples)) return 1;
+
+        bool *done = calloc(test_samples.count, sizeof(bool));
+        assert(test_samples.count == 0 || done != NULL);
+        Eval_Stats stats = {0};
+        Checkpoint cp = {0};
+        if (checkpoint_path != NULL) {
+            const char *header = checkpoint_header(kp, train_path, test_samples.count);
+            if (!checkpoint_open(&cp, checkpoint_path, header, test_samples.count, done, &stats)) return 1;
+            if (stats.count > 0) {
+                nob_log(NOB_INFO, "Resumed from %s: %zu/%zu samples done, success rate %zu/%zu (%f)", checkpoint_path, stats.count, test_samples.count, stats.success, stats.count, (float)stats.success/stats.count);
+            }
+        }
+
+        size_t *order = malloc(test_samples.count*sizeof(*order));
+        assert(test_samples.count == 0 || order != NULL);
+        for (size_t i = 0; i < test_samples.count; ++i) order[i] = i;
+        if (precision > 0) {
+            for (size_t i = test_samples.count; i > 1; --i) {
+                size_t j = rand()%i;
+                size_t t = order[i - 1];
+                order[i - 1] = order[j];
+                order[j] = t;
+            }
+        }
+
+        for (size_t j = 0; j < test_samples.count; ++j) {
+            size_t i = order[j];
+            if (done[i]) continue;
+            Nob_String_View text = test_samples.items[i].text;
+            size_t actual_klass = test_samples.items[i].klass;
+
+            double begin = clock_get_secs();
+            size_t predicted_klass = klass_predictor_predict(kp, text, K);
+            double end = clock_get_secs();
+            Eval_Record record = {
+                .index = i,
+                .predicted_klass = predicted_klass,
+                .actual_klass = actual_klass,
+                .secs = end - begin,
+                .prefix_klass = kp->prefix > 0 ? kp->prefix_klass : predicted_klass,
+                .prefix_secs = kp->prefix_secs,
+                .refine_secs = kp->refine_secs,
+            };
+            eval_stats_add(&stats, &record);
+            if (cp.f != NULL) checkpoint_write(&cp, &record);
+
+            nob_log(NOB_INFO, "Text: "SV_Fmt, SV_Arg(text));
+            nob_log(NOB_INFO, "Predicted Topic: %s", klass_names[predicted_klass]);
+            nob_log(NOB_INFO, "Actual Topic: %s", klass_names[actual_klass]);
+            nob_log(NOB_INFO, "Elapsed Time: %.3lfsecs", end - begin);
+            if (kp->prefix > 0) {
+                nob_log(NOB_INFO, "Prefix Predicted Topic: %s", klass_names[kp->prefix_klass]);
+                nob_log(NOB_INFO, "Prefix Tier: %.3lfsecs, success rate %zu/%zu (%f), average %.3lfsecs", kp->prefix_secs, stats.prefix_success, stats.count, (float)stats.prefix_success/stats.count, stats.prefix_secs/stats.count);
+                nob_log(NOB_INFO, "Refine Tier: %.3lfsecs, success rate %zu/%zu (%f), average %.3lfsecs", kp->refine_secs, stats.success, stats.count, (float)stats.success/stats.count, stats.refine_secs/stats.count);
+            }
+            nob_log(NOB_INFO, "Success: %zu/%zu (%f)", stats.success, test_samples.count, (float)stats.success/test_samples.count);
+            nob_log(NOB_INFO, "Progress: %zu/%zu (%f)", stats.count, test_samples.count, (float)stats.count/test_samples.count);
+            nob_log(NOB_INFO, "Success rate: %zu/%zu (%f)", stats.success, stats.count, (float)stats.success/stats.count);
+            if (precision > 0) {
+                double center = 0;
+                double half_width = eval_interval(stats.success, stats.count, &center);
+                nob_log(NOB_INFO, "Accuracy: %f +- %f (95%% confidence)", center, half_width);
+                if (half_width <= precision) {
+                    nob_log(NOB_INFO, "");
+                    nob_log(NOB_INFO, "Reached the precision of +-%f after %zu/%zu samples", precision, stats.count, test_samples.count);
+                    break;
+                }
+            }
+            nob_log(NOB_INFO, "");
+        }
+
+        if (cp.f != NULL) checkpoint_close(&cp);
+        if (stats.count > 0) {
+            nob_log(NOB_INFO, "Success rate: %zu/%zu (%f), average %.3lfsecs", stats.success, stats.count, (float)stats.success/stats.count, stats.secs/stats.count);
+        }
+        free(order);
+        free(done);
+#ifdef ARENA_STATS
+        klass_predictor_dump_arena_stats(kp);
+#endif // ARENA_STATS
+    }
+
     return 0;
 }